@@ -6,6 +6,7 @@
 #include "hook.h"
 #include "log.hpp"
 #include "3rd_party/MinHook.h"
+#include "trace.hpp"
 #include "utils.hpp"
 
 #define AVS_STRUCT_DEF(ret_type, name, ...) const char* name;
@@ -388,6 +389,7 @@ bool rapidxml_from_avs_filepath(
     rapidxml::xml_document<>& doc,
     rapidxml::xml_document<>& doc_to_allocate_with
 ) {
+    TraceSpan span("xml parse", path.c_str());
     AVS_FILE f = avs_fs_open(path.c_str(), avs_open_mode_read(), 420);
     if (f < 0) {
         log_warning("Couldn't open prop");
@@ -463,6 +465,36 @@ unsigned char* lz_compress(unsigned char* input, size_t length, size_t *compress
     return compress_buffer;
 }
 
+// decompressed_length MUST be set and will be updated on finish
+unsigned char* lz_decompress(unsigned char* input, size_t length, size_t *decompressed_length) {
+    auto compressor = cstream_create(AVS_DECOMPRESS_AVSLZ);
+    if (!compressor) {
+        log_warning("Couldn't create");
+        return NULL;
+    }
+    compressor->input_buffer = input;
+    compressor->input_size = (uint32_t)length; // may be -1 to auto-finish
+    auto decompress_buffer = (unsigned char*)malloc(*decompressed_length);
+    compressor->output_buffer = decompress_buffer;
+    compressor->output_size = (uint32_t)*decompressed_length;
+
+    cstream_operate(compressor);
+    compressor->input_buffer = NULL;
+    compressor->input_size = -1;
+    bool ret = cstream_operate(compressor);
+    if (!ret) {
+        log_warning("Couldn't operate");
+        return NULL;
+    }
+    if (cstream_finish(compressor)) {
+        log_warning("Couldn't finish");
+        return NULL;
+    }
+    *decompressed_length = *decompressed_length - compressor->output_size;
+    cstream_destroy(compressor);
+    return decompress_buffer;
+}
+
 typedef struct {
     uint32_t code;
     const char* msg;
@@ -222,7 +222,10 @@ bool rapidxml_from_avs_filepath(
 );
 std::vector<uint8_t> avs_file_to_vec(AVS_FILE f);
 bool init_avs(void);
+// AVS's own AVSLZ codec, which lz77.hpp reimplements. Kept as a reference
 unsigned char* lz_compress(unsigned char* input, size_t length, size_t *compressed_length);
+// decompressed_length MUST be set and will be updated on finish
+unsigned char* lz_decompress(unsigned char* input, size_t length, size_t *decompressed_length);
 
 const char* get_prop_error_str(int32_t code);
 
@@ -0,0 +1,153 @@
+// Builds everything layeredfs would otherwise build the first time the game
+// asks for it: rewritten texturelists, texture caches, merged XMLs and texbins.
+// Run it from the game folder (the one with data and data_mods) after updating
+// mods, and ship the resulting _cache so nobody sees the first-load stalls.
+// Takes the same --layered-* flags as the DLL. BYO copy of AVS 2.17.x.
+
+#include <windows.h>
+
+#include <atomic>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "avs.h"
+#include "avs_standalone.hpp"
+#include "config.hpp"
+#include "hook.h"
+#include "imagefs.hpp"
+#include "log.hpp"
+#include "modpath_handler.h"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+
+using std::string;
+using std::vector;
+
+// IFS files are mounted under here, so the paths the hooks see still contain
+// "data/..." and normalise the same as the game's
+#define BAKE_MOUNT_ROOT "/layeredfs_bake"
+
+// The AVS path of a file in the game folder, if it exists. AVS standalone
+// roots its filesystem at the working directory.
+static std::optional<string> game_avs_path(const string &norm_path) {
+    // norm paths drop "data/", but keep other game folders like "data2/"
+    for (auto prefix : {"data/", ""}) {
+        auto path = string(prefix) + norm_path;
+        if (file_exists(path.c_str())) {
+            return "/" + path;
+        }
+    }
+    return std::nullopt;
+}
+
+// Open and close a file through the hooks, which builds whatever cache it needs
+static void bake_open(const string &avs_path) {
+    log_verbose("Baking %s", avs_path.c_str());
+    auto f = hook_avs_fs_open(avs_path.c_str(), avs_open_mode_read(), 420);
+    if (f >= 0) {
+        avs_fs_close(f);
+    }
+}
+
+static size_t bake_ifs_files(void) {
+    size_t baked = 0;
+
+    for (auto &ifs_mod_path : find_all_ifs_modfolders()) {
+        auto ifs_path = ifs_mod_path;
+        string_replace(ifs_path, "_ifs", ".ifs");
+
+        // ifs files inside ifs files only exist once their parent is mounted
+        auto avs_path = game_avs_path(ifs_path);
+        if (!avs_path) {
+            log_verbose("No original for %s, skipping", ifs_mod_path.c_str());
+            continue;
+        }
+
+        auto mountpoint = BAKE_MOUNT_ROOT + *avs_path;
+        if (hook_avs_fs_mount(mountpoint.c_str(), avs_path->c_str(), "imagefs", NULL) < 0) {
+            log_warning("Couldn't mount %s", avs_path->c_str());
+            continue;
+        }
+
+        // fills in what the texture caches need to know, and writes the
+        // rewritten texturelist if there are new images
+        bake_open(mountpoint + "/tex/texturelist.xml");
+        baked++;
+    }
+
+    return baked;
+}
+
+static size_t bake_loose_files(void) {
+    vector<string> to_open;
+
+    for (auto &item : find_all_modpaths()) {
+        if (string_ends_with(item, ".merged.xml")) {
+            auto xml_path = item;
+            string_replace(xml_path, ".merged.xml", ".xml");
+            auto avs_path = game_avs_path(xml_path);
+            if (avs_path) {
+                to_open.push_back(*avs_path);
+            }
+        } else if (string_ends_with(item, "/")) {
+            // texbin mod folders are the .bin's path without the extension
+            auto avs_path = game_avs_path(item.substr(0, item.length() - 1) + ".bin");
+            if (avs_path) {
+                to_open.push_back(*avs_path);
+            }
+        }
+    }
+
+    auto total = to_open.size();
+    std::atomic<size_t> finished = 0;
+    background_pool().parallel_for(total, [&](size_t i) {
+        bake_open(to_open[i]);
+        log_info("XMLs and texbins: %d/%d", ++finished, total);
+    });
+
+    return total;
+}
+
+int main(int argc, char** argv) {
+    if(!avs_standalone::boot(false)) {
+        log_fatal("avs_standalone boot failed");
+        return 1;
+    }
+
+    if(init()) {
+        log_fatal("layeredfs init failed");
+        return 1;
+    }
+
+    log_info("cache_bake, from IFS layeredFS v" VER_STRING);
+
+    // nothing is cached in developer mode, which would make this pointless
+    if (config.developer_mode) {
+        log_warning("Ignoring developer mode");
+        config.developer_mode = false;
+        cache_mods();
+    }
+
+    auto start = time_us();
+    auto ifs_count = bake_ifs_files();
+    auto ifs_us = time_us() - start;
+
+    start = time_us();
+    auto loose_count = bake_loose_files();
+    auto loose_us = time_us() - start;
+
+    start = time_us();
+    auto texture_count = cache_all_textures();
+    auto texture_us = time_us() - start;
+
+    log_info("Baked with %d threads:", background_pool().thread_count() + 1);
+    log_info("  %5d texturelists    %8d ms", ifs_count, (int)(ifs_us / 1000));
+    log_info("  %5d XMLs/texbins    %8d ms", loose_count, (int)(loose_us / 1000));
+    log_info("  %5d textures        %8d ms", texture_count, (int)(texture_us / 1000));
+    log_info("  total                  %8d ms", (int)((ifs_us + loose_us + texture_us) / 1000));
+
+    avs_standalone::shutdown();
+
+    return 0;
+}
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include <windows.h>
 #include <shellapi.h>
@@ -13,12 +14,21 @@
 #define BLOCKLIST_FLAG  "--layered-blocklist"
 #define LOGFILE_FLAG    "--layered-logfile"
 #define MOD_FOLDER_FLAG "--layered-data-mods-folder"
+#define PREWARM_FLAG    "--layered-prewarm"
+#define DXT_QUALITY_FLAG "--layered-dxt-quality"
+#define TEXBIN_BGRA_FLAG "--layered-texbin-bgra"
+#define CONTENT_HASH_FLAG "--layered-content-hash"
+#define STATS_FLAG      "--layered-stats"
+#define STATS_INTERVAL_FLAG "--layered-stats-interval"
+#define TRACE_FLAG      "--layered-trace"
 
 config_t config;
 
 // so we can just print the exact arg
 static const char *allowlist = NULL;
 static const char *blocklist = NULL;
+// logging isn't up yet while parsing, so complain in print_config
+static const char *bad_dxt_quality = NULL;
 
 void comma_separated_to_set(std::set<std::string, CaseInsensitiveCompare> &dest, const std::string &arg) {
     size_t last = 0;
@@ -45,6 +55,14 @@ const char* parse_list(const char* prefix, const char* arg, std::set<std::string
 
 void load_config(void) {
     config.disable = false;
+    config.prewarm_textures = false;
+    config.dxt_quality = DXT_QUALITY_FAST;
+    config.texbin_force_bgra = false;
+    config.content_hash = false;
+    config.stats = false;
+    config.stats_interval = 0;
+    config.trace_file = NULL;
+    bad_dxt_quality = NULL;
     config.allowlist.clear();
     config.blocklist.clear();
     config.mod_folder = DEFAULT_MOD_FOLDER;
@@ -80,6 +98,33 @@ void load_config(void) {
         else if (strcmp(__argv[i], DISABLE_FLAG) == 0) {
             config.disable = true;
         }
+        else if (strcmp(__argv[i], PREWARM_FLAG) == 0) {
+            config.prewarm_textures = true;
+        }
+        else if (strcmp(__argv[i], TEXBIN_BGRA_FLAG) == 0) {
+            config.texbin_force_bgra = true;
+        }
+        else if (strcmp(__argv[i], CONTENT_HASH_FLAG) == 0) {
+            config.content_hash = true;
+        }
+        else if (strcmp(__argv[i], STATS_FLAG) == 0) {
+            config.stats = true;
+        }
+        else if (strncmp(__argv[i], STATS_INTERVAL_FLAG, strlen(STATS_INTERVAL_FLAG)) == 0) {
+            const char *seconds = &__argv[i][strlen(STATS_INTERVAL_FLAG)];
+            // correct format: --layered-stats-interval=60
+            if(seconds[0] == '=') {
+                config.stats = true;
+                config.stats_interval = strtoul(&seconds[1], NULL, 10);
+            }
+        }
+        else if (strncmp(__argv[i], TRACE_FLAG, strlen(TRACE_FLAG)) == 0) {
+            const char *path = &__argv[i][strlen(TRACE_FLAG)];
+            // correct format: --layered-trace=trace.json
+            if(path[0] == '=' && path[1]) {
+                config.trace_file = &path[1];
+            }
+        }
         else if (strncmp(__argv[i], ALLOWLIST_FLAG, strlen(ALLOWLIST_FLAG)) == 0) {
             allowlist = parse_list(ALLOWLIST_FLAG, __argv[i], config.allowlist);
         }
@@ -93,6 +138,13 @@ void load_config(void) {
                 config.logfile = &path[1];
             }
         }
+        else if (strncmp(__argv[i], DXT_QUALITY_FLAG, strlen(DXT_QUALITY_FLAG)) == 0) {
+            const char *quality = &__argv[i][strlen(DXT_QUALITY_FLAG)];
+            // correct format: --layered-dxt-quality=high
+            if(quality[0] != '=' || !dxt_quality_from_str(&quality[1], config.dxt_quality)) {
+                bad_dxt_quality = __argv[i];
+            }
+        }
         else if (strncmp(__argv[i], MOD_FOLDER_FLAG, strlen(MOD_FOLDER_FLAG)) == 0) {
             std::string_view path = &__argv[i][strlen(MOD_FOLDER_FLAG)];
             // correct format: --layered-data-mods-folder=./my_mods
@@ -104,13 +156,24 @@ void load_config(void) {
 }
 
 void print_config(void) {
-    log_info("Options: %s=%d %s=%d %s=%d %s=%s %s=%s %s=%s %s=%s",
+    log_info("Options: %s=%d %s=%d %s=%d %s=%d %s=%s %s=%d %s=%d %s=%d %s=%d %s=%s %s=%s %s=%s %s=%s %s=%s",
         VERBOSE_FLAG, config.verbose_logs,
         DEVMODE_FLAG, config.developer_mode,
         DISABLE_FLAG, config.disable,
+        PREWARM_FLAG, config.prewarm_textures,
+        DXT_QUALITY_FLAG, dxt_quality_str(config.dxt_quality),
+        TEXBIN_BGRA_FLAG, config.texbin_force_bgra,
+        CONTENT_HASH_FLAG, config.content_hash,
+        STATS_FLAG, config.stats,
+        STATS_INTERVAL_FLAG, config.stats_interval,
+        TRACE_FLAG, config.trace_file,
         LOGFILE_FLAG, config.logfile,
         ALLOWLIST_FLAG, allowlist,
         BLOCKLIST_FLAG, blocklist,
         MOD_FOLDER_FLAG, config.mod_folder.c_str()
     );
+
+    if (bad_dxt_quality) {
+        log_warning("Ignoring %s, expected %s=fast|high|best", bad_dxt_quality, DXT_QUALITY_FLAG);
+    }
 }
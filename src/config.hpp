@@ -3,12 +3,22 @@
 #include <set>
 #include <string>
 
+#include "dxt.hpp"
 #include "utils.hpp"
 
 typedef struct {
     bool verbose_logs;
     bool developer_mode;
     bool disable;
+    bool prewarm_textures;
+    dxt_quality_t dxt_quality;
+    bool texbin_force_bgra;
+    bool content_hash;
+    bool stats;
+    // seconds between stats dumps, 0 to only dump at exit
+    uint32_t stats_interval;
+    // where to write a chrome://tracing timeline at exit, or NULL
+    const char *trace_file;
     const char *logfile;
     std::set<std::string, CaseInsensitiveCompare> allowlist;
     std::set<std::string, CaseInsensitiveCompare> blocklist;
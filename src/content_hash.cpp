@@ -0,0 +1,239 @@
+#include "content_hash.hpp"
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <climits>
+#include <string>
+#include <unordered_map>
+
+#include "config.hpp"
+#include "hook.h"
+#include "log.hpp"
+#include "modpath_handler.h"
+#include "utils.hpp"
+#include "winxp_mutex.hpp"
+#include "3rd_party/MurmurHash3.h"
+
+using std::string;
+
+#define CONTENT_HASH_FILE (CACHE_FOLDER + "/content_hashes.bin")
+#define CONTENT_HASH_MAGIC "LFCH"
+#define CONTENT_HASH_VERSION 1
+
+// The table on disk is a magic and version, then an append-only log of
+// records. Later records for a path replace earlier ones.
+typedef struct {
+    uint64_t size;
+    uint64_t mtime;
+    content_hash_t hash;
+} content_hash_entry_t;
+
+static CriticalSectionLock hashes_lock;
+static bool hashes_loaded = false;
+static std::unordered_map<string, content_hash_entry_t, CaseInsensitiveHash, CaseInsensitiveEqual> hashes;
+static size_t records_on_disk = 0;
+
+static bool write_record(FILE *f, const string &path, const content_hash_entry_t &entry) {
+    uint32_t path_len = (uint32_t)path.size();
+    return fwrite(&path_len, sizeof(path_len), 1, f) == 1 &&
+        fwrite(path.c_str(), 1, path_len, f) == path_len &&
+        fwrite(&entry, sizeof(entry), 1, f) == 1;
+}
+
+// start the file over with just the live entries. Called with hashes_lock held
+static void rewrite_table() {
+    if (!mkdir_p(CACHE_FOLDER)) {
+        return;
+    }
+
+    auto f = fopen(CONTENT_HASH_FILE.c_str(), "wb");
+    if (!f) {
+        log_warning("Couldn't write content hash table");
+        return;
+    }
+
+    uint32_t version = CONTENT_HASH_VERSION;
+    fwrite(CONTENT_HASH_MAGIC, 1, 4, f);
+    fwrite(&version, sizeof(version), 1, f);
+    for (auto &[path, entry] : hashes) {
+        write_record(f, path, entry);
+    }
+    fclose(f);
+
+    records_on_disk = hashes.size();
+}
+
+// called with hashes_lock held
+static void load_table() {
+    hashes_loaded = true;
+
+    auto f = fopen(CONTENT_HASH_FILE.c_str(), "rb");
+    if (!f) {
+        rewrite_table();
+        return;
+    }
+
+    char magic[4];
+    uint32_t version;
+    bool valid = fread(magic, 1, 4, f) == 4 && memcmp(magic, CONTENT_HASH_MAGIC, 4) == 0 &&
+        fread(&version, sizeof(version), 1, f) == 1 && version == CONTENT_HASH_VERSION;
+
+    // a torn write at the end just loses that one record
+    uint32_t path_len;
+    string path;
+    content_hash_entry_t entry;
+    bool torn = false;
+    while (valid) {
+        auto read = fread(&path_len, 1, sizeof(path_len), f);
+        if (read == 0) {
+            break;
+        }
+        if (read != sizeof(path_len) || path_len > MAX_PATH) {
+            torn = true;
+            break;
+        }
+        path.resize(path_len);
+        if (fread(&path[0], 1, path_len, f) != path_len || fread(&entry, sizeof(entry), 1, f) != 1) {
+            torn = true;
+            break;
+        }
+        hashes[path] = entry;
+        records_on_disk++;
+    }
+    fclose(f);
+
+    log_verbose("Loaded %d content hashes", (int)hashes.size());
+
+    // Not ours, mostly superseded records, or torn. New records are appended,
+    // so they'd be lost behind a torn one unless it's cut off.
+    if (!valid || torn || records_on_disk > hashes.size() * 2 + 64) {
+        rewrite_table();
+    }
+}
+
+static bool file_stat(const char *path, uint64_t &size, uint64_t &mtime) {
+    if (mod_file_attribs_cached(path, size, mtime)) {
+        return mtime != 0;
+    }
+
+    WIN32_FILE_ATTRIBUTE_DATA attribs;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attribs) ||
+        (attribs.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        return false;
+    }
+
+    size = ((uint64_t)attribs.nFileSizeHigh << 32) | attribs.nFileSizeLow;
+    ULARGE_INTEGER time;
+    time.LowPart = attribs.ftLastWriteTime.dwLowDateTime;
+    time.HighPart = attribs.ftLastWriteTime.dwHighDateTime;
+    mtime = time.QuadPart;
+    return true;
+}
+
+static std::optional<content_hash_t> hash_file(const char *path, uint64_t size) {
+    content_hash_t hash;
+    if (size == 0) {
+        MurmurHash3_x64_128("", 0, 0, hash.h);
+        return hash;
+    }
+    // MurmurHash3 takes an int length, and nothing we cache is this big
+    if (size > INT_MAX) {
+        return std::nullopt;
+    }
+
+    auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return std::nullopt;
+    }
+    auto mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) {
+        return std::nullopt;
+    }
+    auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view) {
+        return std::nullopt;
+    }
+
+    MurmurHash3_x64_128(view, (int)size, 0, hash.h);
+    UnmapViewOfFile(view);
+    return hash;
+}
+
+std::optional<content_hash_t> file_content_hash(const char *path) {
+    content_hash_entry_t entry;
+    if (!file_stat(path, entry.size, entry.mtime)) {
+        return std::nullopt;
+    }
+
+    hashes_lock.lock();
+    if (!hashes_loaded) {
+        load_table();
+    }
+    auto existing = hashes.find(path);
+    if (existing != hashes.end() && existing->second.size == entry.size && existing->second.mtime == entry.mtime) {
+        auto hash = existing->second.hash;
+        hashes_lock.unlock();
+        return hash;
+    }
+    hashes_lock.unlock();
+
+    // reading is the slow part, so don't hold everyone else up
+    auto hash = hash_file(path, entry.size);
+    if (!hash) {
+        return std::nullopt;
+    }
+    entry.hash = *hash;
+
+    hashes_lock.lock();
+    hashes[path] = entry;
+    auto f = fopen(CONTENT_HASH_FILE.c_str(), "ab");
+    if (f) {
+        write_record(f, path, entry);
+        fclose(f);
+        records_on_disk++;
+    }
+    hashes_lock.unlock();
+
+    return hash;
+}
+
+size_t content_hash_reload(void) {
+    hashes_lock.lock();
+    hashes.clear();
+    records_on_disk = 0;
+    load_table();
+    auto count = hashes.size();
+    hashes_lock.unlock();
+
+    return count;
+}
+
+void digest_add_file_version(MD5 &digest, const char *path) {
+    if (config.content_hash) {
+        auto hash = file_content_hash(path);
+        if (hash) {
+            digest.add(hash->h, sizeof(hash->h));
+            return;
+        }
+    }
+
+    auto ts = file_time(path);
+    digest.add(&ts, sizeof(ts));
+}
+
+void digest_add_dll_version(MD5 &digest) {
+    if (config.content_hash) {
+        // can't change while we're running, so no need to even stat it again
+        static auto dll_hash = file_content_hash(dll_filename);
+        if (dll_hash) {
+            digest.add(dll_hash->h, sizeof(dll_hash->h));
+            return;
+        }
+    }
+
+    digest.add(&dll_time, sizeof(dll_time));
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <optional>
+
+#include "3rd_party/md5.h"
+
+// 128 bit MurmurHash3 of a file's contents
+typedef struct {
+    uint64_t h[2];
+} content_hash_t;
+
+// Hashes are remembered by (path, size, mtime) in the cache folder, so a file
+// is only read again once it changes. nullopt if it can't be read.
+std::optional<content_hash_t> file_content_hash(const char *path);
+// Forget every remembered hash and load content_hashes.bin again, returning
+// how many it had. For tests.
+size_t content_hash_reload(void);
+
+// Add whatever identifies this version of a file to a cache key: its contents
+// with --layered-content-hash, otherwise its mtime
+void digest_add_file_version(MD5 &digest, const char *path);
+// the same, for our own DLL
+void digest_add_dll_version(MD5 &digest);
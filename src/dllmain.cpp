@@ -1,11 +1,14 @@
 // dllmain.cpp : Defines the entry point for the DLL application.
 #include <windows.h>
 #include "hook.h"
+#include "stats.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 
 HMODULE my_module;
 char dll_filename[MAX_PATH];
 uint64_t dll_time;
+bool inside_dllmain;
 
 BOOL APIENTRY DllMain( HMODULE hModule,
                        DWORD  ul_reason_for_call,
@@ -19,10 +22,24 @@ BOOL APIENTRY DllMain( HMODULE hModule,
     if (GetModuleFileNameA(my_module, dll_filename, MAX_PATH)) {
       dll_time = file_time(dll_filename);
     }
-    return init() == 0;
+    // we can't wait on any threads while holding the loader lock
+    inside_dllmain = true;
+    {
+        auto ret = init();
+        inside_dllmain = false;
+        return ret == 0;
+    }
     case DLL_THREAD_ATTACH:
     case DLL_THREAD_DETACH:
+        break;
     case DLL_PROCESS_DETACH:
+        // Being unloaded, rather than the process exiting. On exit every
+        // other thread is already dead, maybe holding locks we'd need, so
+        // hook_ExitProcess does this instead.
+        if (lpReserved == NULL) {
+            stats_dump();
+            trace_dump();
+        }
         break;
     }
     return TRUE;
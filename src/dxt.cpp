@@ -0,0 +1,95 @@
+#include "dxt.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "3rd_party/stb_dxt.h"
+#include "3rd_party/libsquish/squish.h"
+
+#include "thread_pool.hpp"
+
+#define DXT_BLOCK 4
+// 64 pixel high bands, enough work per item that the pool overhead vanishes
+#define DXT_BAND_BLOCK_ROWS 16
+
+static const char *quality_names[] = {
+    "fast",
+    "high",
+    "best",
+};
+
+bool dxt_quality_from_str(const char *str, dxt_quality_t &quality) {
+    for (size_t i = 0; i < sizeof(quality_names) / sizeof(*quality_names); i++) {
+        if (strcmp(str, quality_names[i]) == 0) {
+            quality = (dxt_quality_t)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const char *dxt_quality_str(dxt_quality_t quality) {
+    return quality_names[quality];
+}
+
+static size_t block_bytes(dxt_format_t format) {
+    return format == DXT_FORMAT_DXT1 ? 8 : 16;
+}
+
+size_t dxt_compressed_size(int width, int height, dxt_format_t format) {
+    size_t blocks_x = (width + DXT_BLOCK - 1) / DXT_BLOCK;
+    size_t blocks_y = (height + DXT_BLOCK - 1) / DXT_BLOCK;
+    return blocks_x * blocks_y * block_bytes(format);
+}
+
+static void compress_band(uint8_t *dst, const uint8_t *rgba, int width, int height, dxt_format_t format, dxt_quality_t quality) {
+    static const int squish_formats[] = {squish::kDxt1, squish::kDxt3, squish::kDxt5};
+    auto squish_format = squish_formats[format];
+
+    switch (quality) {
+    case DXT_QUALITY_HIGH:
+        squish::CompressImage(rgba, width, height, dst, squish_format | squish::kColourClusterFit);
+        break;
+    case DXT_QUALITY_BEST:
+        squish::CompressImage(rgba, width, height, dst, squish_format | squish::kColourIterativeClusterFit);
+        break;
+    default:
+        if (format == DXT_FORMAT_DXT3) {
+            squish::CompressImage(rgba, width, height, dst, squish_format | squish::kColourRangeFit);
+        } else {
+            // doesn't modify the source, it's just not const-correct
+            rygCompress(dst, (unsigned char*)rgba, width, height, format == DXT_FORMAT_DXT5);
+        }
+        break;
+    }
+}
+
+void dxt_compress(uint8_t *dst, const uint8_t *rgba, int width, int height, dxt_format_t format, dxt_quality_t quality) {
+    // stb_dxt builds its lookup tables on first use, which isn't thread safe
+    static bool stb_ready = [] {
+        uint8_t block[DXT_BLOCK * DXT_BLOCK * 4] = {0};
+        uint8_t out[16];
+        rygCompress(out, block, DXT_BLOCK, DXT_BLOCK, 1);
+        return true;
+    }();
+    (void)stb_ready;
+
+    // Blocks only ever read their own 4x4 pixels, so a band of whole block
+    // rows compresses exactly as it would as part of the full image. The last
+    // band keeps any partial block row.
+    int block_rows = (height + DXT_BLOCK - 1) / DXT_BLOCK;
+    size_t row_bytes = dxt_compressed_size(width, DXT_BLOCK, format);
+    size_t bands = (block_rows + DXT_BAND_BLOCK_ROWS - 1) / DXT_BAND_BLOCK_ROWS;
+
+    background_pool().parallel_for(bands, [&](size_t band) {
+        int y = (int)band * DXT_BAND_BLOCK_ROWS * DXT_BLOCK;
+        int band_height = std::min(DXT_BAND_BLOCK_ROWS * DXT_BLOCK, height - y);
+        compress_band(
+            &dst[band * DXT_BAND_BLOCK_ROWS * row_bytes],
+            &rgba[(size_t)y * width * 4],
+            width, band_height, format, quality
+        );
+    });
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    DXT_FORMAT_DXT1,
+    DXT_FORMAT_DXT3,
+    DXT_FORMAT_DXT5,
+} dxt_format_t;
+
+typedef enum {
+    // stb_dxt, what layeredfs has always used. DXT3 isn't supported by it, so
+    // uses libsquish range fit instead
+    DXT_QUALITY_FAST,
+    // libsquish cluster fit. Roughly 100x slower
+    DXT_QUALITY_HIGH,
+    // libsquish iterative cluster fit. Slower again, for the patient
+    DXT_QUALITY_BEST,
+} dxt_quality_t;
+
+// bytes needed to hold a compressed image, including partial blocks
+size_t dxt_compressed_size(int width, int height, dxt_format_t format);
+
+// Compress 32bpp RGBA into dst, which must be dxt_compressed_size bytes. Bands
+// of block rows are spread over the background pool, and the output is
+// identical to compressing on one thread.
+void dxt_compress(uint8_t *dst, const uint8_t *rgba, int width, int height, dxt_format_t format, dxt_quality_t quality);
+
+// parse a --layered-dxt-quality value, false if it isn't one
+bool dxt_quality_from_str(const char *str, dxt_quality_t &quality);
+const char *dxt_quality_str(dxt_quality_t quality);
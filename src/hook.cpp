@@ -4,11 +4,11 @@
 
 // all good code mixes C and C++, right?
 using std::string;
+#include <atomic>
 #include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
 #include <iostream>
-#include <sstream>
 
 #include "3rd_party/MinHook.h"
 
@@ -20,6 +20,8 @@ using std::string;
 #include "utils.hpp"
 #include "avs.h"
 #include "modpath_handler.h"
+#include "stats.hpp"
+#include "trace.hpp"
 
 // let me use the std:: version, damnit
 #undef max
@@ -39,6 +41,16 @@ using std::string;
 // used by pkfs hooks - we don't want to hook avs_fs_open if we just hooked pkfs
 thread_local static bool inside_pkfs_hook;
 
+// how many hooked calls were rejected by the negative lookup filter
+static std::atomic<uint32_t> fast_path_count;
+
+static void count_fast_path() {
+    auto count = ++fast_path_count;
+    if (count % 1000 == 0) {
+        log_verbose("%u unmodded files took the fast path", count);
+    }
+}
+
 unsigned int (*pkfs_fs_open)(const char *path);
 unsigned int (*pkfs_fs_fstat)(unsigned int f, struct avs_stat *stat);
 unsigned int (*pkfs_fs_read)(unsigned int f, void *buf, int sz);
@@ -198,6 +210,8 @@ void handle_texbin(HookFile &file) {
         return;
     }
 
+    TraceSpan span("handle_texbin", file.norm_path.c_str());
+
     auto pngs = list_pngs(bin_mod_path);
 
     //// This whole hashing section is just a tiny bit different from the XML
@@ -233,6 +247,9 @@ void handle_texbin(HookFile &file) {
     for (auto &path : pngs_list) {
         cache_hasher.add(path);
     }
+    // both change the encoded images, same as image_cache_key
+    cache_hasher.add_bytes(&config.texbin_force_bgra, sizeof(config.texbin_force_bgra));
+    cache_hasher.add_bytes(&config.dxt_quality, sizeof(config.dxt_quality));
     cache_hasher.finish();
 
     // no need to merge - timestamps all up to date, dll not newer, files haven't been deleted
@@ -246,15 +263,14 @@ void handle_texbin(HookFile &file) {
     Texbin texbin;
     auto _orig_data = file.load_to_vec();
     if (_orig_data) {
-        auto orig_data = *_orig_data;
-        // one extra copy which *sucks* but whatever
-        std::istringstream stream(string((char*)&orig_data[0], orig_data.size()));
-        auto _texbin = Texbin::from_stream(stream);
+        // untouched images are written straight from here, never copied
+        auto orig_data = make_shared<vector<uint8_t>>(std::move(*_orig_data));
+        auto _texbin = Texbin::from_buffer(orig_data->data(), orig_data->size(), orig_data);
         if(!_texbin) {
             log_warning("Texbin load failed, aborting modding");
             return;
         }
-        texbin = *_texbin;
+        texbin = std::move(*_texbin);
     } else {
         log_info("Found texbin mods but no original file, creating from scratch: \"%s\"", file.norm_path.c_str());
     }
@@ -266,13 +282,26 @@ void handle_texbin(HookFile &file) {
         return;
     }
 
+    // so touching one PNG only re-encodes that one image
+    auto image_cache_folder = out + "_images";
+    if (mkdir_p(image_cache_folder)) {
+        texbin.image_cache_folder = image_cache_folder;
+    }
+
+    vector<pair<string, string>> replacements;
+    replacements.reserve(pngs_list.size());
     for (auto &path : pngs_list) {
         // I have yet to see a texbin without allcaps names for textures
         auto tex_name = basename_without_extension(path);
         str_toupper_inline(tex_name);
-        texbin.add_or_replace_image(tex_name.c_str(), path.c_str());
+        replacements.emplace_back(tex_name, path);
     }
 
+    auto images_start = time_us();
+    uint64_t images_work_us = 0;
+    texbin.add_or_replace_images(replacements, &images_work_us);
+    auto images_wall_us = time_us() - images_start;
+
     if(!texbin.save(out.c_str())) {
         log_warning("Texbin: Couldn't create output");
         return;
@@ -280,8 +309,11 @@ void handle_texbin(HookFile &file) {
 
     cache_hasher.commit();
     file.mod_path = out;
+    stats_count(STATS_TEXBIN_BUILT);
 
-    log_misc("Texbin generation took %d ms", time() - start);
+    log_misc("Texbin generation took %d ms (%d images, %.1fx faster than serial)",
+        time() - start, replacements.size(),
+        images_wall_us ? (double)images_work_us / images_wall_us : 1.0);
 }
 
 uint32_t handle_file_open(HookFile &file) {
@@ -318,40 +350,53 @@ uint32_t handle_file_open(HookFile &file) {
 }
 
 int hook_avs_fs_lstat(const char* name, struct avs_stat *st) {
+    StatsTimer timer(STATS_AVS_FS_LSTAT);
     if (name == NULL)
         return avs_fs_lstat(name, st);
 
     log_verbose("statting %s", name);
-    string path = name;
-
     // can it be modded ie is it under /data ?
-    auto norm_path = normalise_path(path);
+    norm_path_buf norm_buf;
+    auto norm_path = normalise_path(name, norm_buf);
     if (!norm_path)
         return avs_fs_lstat(name, st);
+    if (!may_be_modded(*norm_path)) {
+        count_fast_path();
+        return avs_fs_lstat(name, st);
+    }
     // unpack success
-    AvsLstatHookFile file(path, *norm_path, st);
+    AvsLstatHookFile file(name, string(*norm_path), st);
 
-    return handle_file_open(file);
+    auto ret = handle_file_open(file);
+    timer.modded = file.mod_path.has_value();
+    return ret;
 }
 
 int hook_avs_fs_convert_path(char dest_name[256], const char *name) {
+    StatsTimer timer(STATS_AVS_FS_CONVERT_PATH);
     if (name == NULL)
         return avs_fs_convert_path(dest_name, name);
 
     log_verbose("convert_path %s", name);
-    string path = name;
-
     // can it be modded ie is it under /data ?
-    auto norm_path = normalise_path(path);
+    norm_path_buf norm_buf;
+    auto norm_path = normalise_path(name, norm_buf);
     if (!norm_path)
         return avs_fs_convert_path(dest_name, name);
+    if (!may_be_modded(*norm_path)) {
+        count_fast_path();
+        return avs_fs_convert_path(dest_name, name);
+    }
     // unpack success
-    AvsConvertPathHookFile file(path, *norm_path, dest_name);
+    AvsConvertPathHookFile file(name, string(*norm_path), dest_name);
 
-    return handle_file_open(file);
+    auto ret = handle_file_open(file);
+    timer.modded = file.mod_path.has_value();
+    return ret;
 }
 
 int hook_avs_fs_mount(const char* mountpoint, const char* fsroot, const char* fstype, const char* args) {
+    StatsTimer timer(STATS_AVS_FS_MOUNT);
     log_verbose("mounting %s to %s with type %s and args %s", fsroot, mountpoint, fstype, args);
     ramfs_demangler_on_fs_mount(mountpoint, fsroot, fstype, args);
 
@@ -368,11 +413,13 @@ int hook_avs_fs_mount(const char* mountpoint, const char* fsroot, const char* fs
 }
 
 size_t hook_avs_fs_read(AVS_FILE context, void* bytes, size_t nbytes) {
+    StatsTimer timer(STATS_AVS_FS_READ);
     ramfs_demangler_on_fs_read(context, bytes);
     return avs_fs_read(context, bytes, nbytes);
 }
 
 AVS_FILE hook_avs_fs_open(const char* name, uint16_t mode, int flags) {
+    StatsTimer timer(STATS_AVS_FS_OPEN);
     if(name == NULL || inside_pkfs_hook)
         return avs_fs_open(name, mode, flags);
     log_verbose("opening %s mode %d flags %d", name, mode, flags);
@@ -380,31 +427,52 @@ AVS_FILE hook_avs_fs_open(const char* name, uint16_t mode, int flags) {
     if ((avs_loaded_version >= 1400 && mode != 1) || (avs_loaded_version < 1400 && mode != 0)) {
         return avs_fs_open(name, mode, flags);
     }
-    string path = name;
-
     // can it be modded ie is it under /data ?
-    auto norm_path = normalise_path(path);
+    norm_path_buf norm_buf;
+    auto norm_path = normalise_path(name, norm_buf);
     if (!norm_path)
         return avs_fs_open(name, mode, flags);
+    if (!may_be_modded(*norm_path)) {
+        count_fast_path();
+        auto ret = avs_fs_open(name, mode, flags);
+        // unmodded IFS files still need tracking for ramfs demangling
+        if (ret >= 0 && string_ends_with(name, ".ifs")) {
+            ramfs_demangler_on_fs_open(name, ret);
+        }
+        return ret;
+    }
     // unpack success
-    AvsOpenHookFile file(path, *norm_path, mode, flags);
+    AvsOpenHookFile file(name, string(*norm_path), mode, flags);
 
-    return handle_file_open(file);
+    auto ret = handle_file_open(file);
+    timer.modded = file.mod_path.has_value();
+    return ret;
+}
+
+// The game exiting normally. Unlike DLL_PROCESS_DETACH, every other thread is
+// still alive and the loader lock isn't held, so it's safe to wait on locks.
+static void (WINAPI *real_ExitProcess)(UINT exit_code);
+static void WINAPI hook_ExitProcess(UINT exit_code) {
+    // the game has likely shut AVS down already
+    log_to_logfile();
+    stats_dump();
+    trace_dump();
+    real_ExitProcess(exit_code);
 }
 
 unsigned int hook_pkfs_open(const char *name) {
+    StatsTimer timer(STATS_PKFS_OPEN);
     log_verbose("pkfs_open %s", name);
 
-    string path = name;
-
     // can it be modded ie is it under /data ?
-    auto norm_path = normalise_path(path);
+    norm_path_buf norm_buf;
+    auto norm_path = normalise_path(name, norm_buf);
     if (!norm_path) {
         log_verbose("pkfs_open falling back to real (no norm)");
         return pkfs_fs_open(name);
     }
     // unpack success
-    PkfsHookFile file(path, *norm_path);
+    PkfsHookFile file(name, string(*norm_path));
 
     // note that this also hides the avs_fs_open of the pakfile holding a
     // particular file - acceptable compromise IMO
@@ -436,6 +504,7 @@ unsigned int hook_pkfs_open(const char *name) {
 
     auto ret = handle_file_open(file);
     inside_pkfs_hook = false;
+    timer.modded = file.mod_path.has_value();
     return ret;
 }
 
@@ -475,8 +544,12 @@ extern "C" {
         log_info(".pak dumper mode enabled");
 #endif
 
+        stats_init();
         init_modpath_handler();
         cache_mods();
+        if (config.prewarm_textures) {
+            start_texture_prewarm();
+        }
 
         // hook pkfs, not big enough to be its own file
         if(MH_CreateHookApi(L"libpackfs.dll", "?pkfs_fs_open@@YAIPBD@Z", (LPVOID)&hook_pkfs_open, (LPVOID*)&pkfs_fs_open) == MH_OK) {
@@ -502,6 +575,13 @@ extern "C" {
             }
         }
 
+        // only to write out what we've collected
+        if (config.stats || config.trace_file) {
+            if (MH_CreateHookApi(L"kernel32.dll", "ExitProcess", (LPVOID)&hook_ExitProcess, (LPVOID*)&real_ExitProcess) != MH_OK) {
+                log_warning("Couldn't hook ExitProcess, nothing will be written at exit");
+            }
+        }
+
         if (MH_EnableHook(MH_ALL_HOOKS) != MH_OK) {
             log_warning("Couldn't enable hooks");
             return 2;
@@ -7,7 +7,10 @@
 #include "log.hpp"
 #include "utils.hpp"
 
+extern char dll_filename[MAX_PATH];
 extern uint64_t dll_time;
+// true while init() is running from DllMain, under the loader lock
+extern bool inside_dllmain;
 
 AVS_FILE hook_avs_fs_open(const char* name, uint16_t mode, int flags);
 int hook_avs_fs_lstat(const char* name, struct avs_stat *st);
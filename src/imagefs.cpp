@@ -1,21 +1,30 @@
 #include "imagefs.hpp"
 
 #include <inttypes.h>
+#include <atomic>
 #include <map>
 #include <fstream>
 #include <memory>
 #include <sstream>
+#include <unordered_map>
 
 #include "3rd_party/lodepng.h"
-#include "3rd_party/stb_dxt.h"
 #include "3rd_party/GuillotineBinPack.h"
 #include "3rd_party/rapidxml_print.hpp"
 #include "3rd_party/md5.h"
 
 #include "avs.h"
+#include "content_hash.hpp"
+#include "dxt.hpp"
 #include "log.hpp"
+#include "lz77.hpp"
 #include "modpath_handler.h"
+#include "sharded_map.hpp"
+#include "stats.hpp"
+#include "swizzle.hpp"
+#include "trace.hpp"
 #include "texture_packer.h"
+#include "thread_pool.hpp"
 #include "utils.hpp"
 #include "winxp_mutex.hpp"
 
@@ -49,12 +58,151 @@ typedef struct afp {
     string mod_path;
 } afp_t;
 
-// ifs_textures["data/graphics/ver04/logo.ifs/tex/4f754d4f424f092637a49a5527ece9bb"] will be "konami"
-static std::map<string, std::shared_ptr<image_t>, CaseInsensitiveCompare> ifs_textures;
-static CriticalSectionLock ifs_textures_mtx;
+// ifs_textures["data/graphics/ver04/logo.ifs/tex/4f754d4f424f092637a49a5527ece9bb"] will be "konami".
+// Looked up for every texture the game opens, possibly from several threads.
+static ShardedMap<std::shared_ptr<image_t>> ifs_textures;
+
+static ShardedMap<std::shared_ptr<afp_t>> afp_md5_names;
+
+// A texture cache file that a background job has been queued to build. The
+// lock is held while building, so whoever gets there first (the job or the
+// game) does the work, and the other waits for it instead of writing the same
+// file. Only set under the lock, but may be peeked at without it.
+typedef struct {
+    CriticalSectionLock lock;
+    std::atomic<bool> done;
+} texture_job_t;
+
+// cache file -> job. Filled by the pre-warm before the hooks are enabled, and
+// by parse_texturelist after. A finished job may be replaced by a new one, but
+// entries are never removed.
+static std::unordered_map<string, std::shared_ptr<texture_job_t>, CaseInsensitiveHash, CaseInsensitiveEqual> texture_jobs;
+static CriticalSectionLock texture_jobs_mtx;
+
+static std::shared_ptr<texture_job_t> find_texture_job(const string &cache_file) {
+    texture_jobs_mtx.lock();
+    auto search = texture_jobs.find(cache_file);
+    auto job = search == texture_jobs.end() ? nullptr : search->second;
+    texture_jobs_mtx.unlock();
+    return job;
+}
+
+// Call with texture_jobs_mtx held. nullptr if the texture is already queued
+// or being built.
+static std::shared_ptr<texture_job_t> new_texture_job(const string &cache_file) {
+    auto &job = texture_jobs[cache_file];
+    if (job && !job->done) {
+        return nullptr;
+    }
+
+    job = std::make_shared<texture_job_t>();
+    job->done = false;
+    return job;
+}
+
+typedef struct {
+    string png_path;
+    image_t tex;
+    std::shared_ptr<texture_job_t> job;
+} texture_build_t;
+
+static void start_ifs_texture_jobs(const string &ifs_mod_path, const vector<std::shared_ptr<image_t>> &images);
+
+// The format and size of every texture only exist in the IFS' texturelist.xml,
+// which we can't read until the game mounts it. So parse_texturelist saves
+// what it learns in a manifest next to the cached textures, which the next
+// boot's pre-warm uses. One "name\tformat\tcompression\twidth\theight" line per
+// image.
+#define TEXTURE_MANIFEST "texturelist.manifest"
+
+static string manifest_line(const image_t &tex) {
+    char params[64];
+    snprintf(params, sizeof(params), "\t%d\t%d\t%d\t%d\n", tex.format, tex.compression, tex.width, tex.height);
+    return tex.name + params;
+}
+
+static std::optional<image_t> parse_manifest_line(const string &line, const string &ifs_mod_path) {
+    auto tab = line.find('\t');
+    if (tab == string::npos) {
+        return std::nullopt;
+    }
+
+    int format, compression, width, height;
+    if (sscanf(&line[tab], "%d %d %d %d", &format, &compression, &width, &height) != 4 ||
+        format < 0 || format > UNSUPPORTED_FORMAT ||
+        compression < 0 || compression > UNSUPPORTED_COMPRESS) {
+        return std::nullopt;
+    }
+
+    image_t tex;
+    tex.name = line.substr(0, tab);
+    tex.name_md5 = MD5()(tex.name);
+    tex.format = (img_format)format;
+    tex.compression = (compress_type)compression;
+    tex.ifs_mod_path = ifs_mod_path;
+    tex.width = width;
+    tex.height = height;
+    return tex;
+}
+
+// name -> manifest line
+static std::map<string, string> load_manifest(const string &ifs_mod_path) {
+    std::map<string, string> ret;
+
+    std::ifstream f(CACHE_FOLDER + "/" + ifs_mod_path + "/" TEXTURE_MANIFEST);
+    string line;
+    while (std::getline(f, line)) {
+        auto tab = line.find('\t');
+        if (tab != string::npos) {
+            ret[line.substr(0, tab)] = line + "\n";
+        }
+    }
+
+    return ret;
+}
+
+static void update_manifest(const string &ifs_mod_path, const vector<std::shared_ptr<image_t>> &images) {
+    std::map<string, string> manifest;
+    for (auto &tex : images) {
+        manifest[tex->name] = manifest_line(*tex);
+    }
+
+    auto old_manifest = load_manifest(ifs_mod_path);
+    if (manifest == old_manifest) {
+        return;
+    }
+
+    // The game data changed under us (or this is the first boot). Anything a
+    // pre-warm built from the old parameters is wrong, and the cache freshness
+    // check won't notice since the PNG hasn't changed.
+    for (auto &[name, line] : old_manifest) {
+        auto search = manifest.find(name);
+        if (search != manifest.end() && search->second == line) {
+            continue;
+        }
+
+        auto cache_file = CACHE_FOLDER + "/" + ifs_mod_path + "/" + MD5()(name);
+        auto job = find_texture_job(cache_file);
+        if (job) {
+            job->lock.lock();
+            job->done = true;
+        }
+        DeleteFileA(cache_file.c_str());
+        if (job) {
+            job->lock.unlock();
+        }
+    }
 
-static std::map<std::string, std::shared_ptr<afp_t>, CaseInsensitiveCompare> afp_md5_names;
-static CriticalSectionLock afp_md5_names_mtx;
+    auto folder = CACHE_FOLDER + "/" + ifs_mod_path;
+    if (!mkdir_p(folder)) {
+        log_warning("Couldn't create cache folder");
+        return;
+    }
+    std::ofstream f(folder + "/" TEXTURE_MANIFEST, std::ios::binary);
+    for (auto &[name, line] : manifest) {
+        f << line;
+    }
+}
 
 
 void rapidxml_dump_to_file(const string& out, const rapidxml::xml_document<> &xml) {
@@ -63,7 +211,11 @@ void rapidxml_dump_to_file(const string& out, const rapidxml::xml_document<> &xm
 
     // this is 3x faster than writing directly to the output file
     std::string s;
-    print(std::back_inserter(s), xml, rapidxml::print_no_indenting);
+    {
+        TraceSpan span("xml dump", out.c_str());
+        print(std::back_inserter(s), xml, rapidxml::print_no_indenting);
+    }
+    TraceSpan span("file write", out.c_str());
     out_file << s;
 
     out_file.close();
@@ -83,7 +235,8 @@ rapidxml::xml_node<>* allocate_node_and_attrib(
     return node;
 }
 
-bool add_images_to_list(string_set &extra_pngs, rapidxml::xml_node<> *texturelist_node, string const&ifs_path, string const&ifs_mod_path, compress_type compress) {
+bool add_images_to_list(string_set &extra_pngs, rapidxml::xml_node<> *texturelist_node, string const&ifs_path, string const&ifs_mod_path, compress_type compress, vector<std::shared_ptr<image_t>> &images) {
+    TraceSpan span("add_images_to_list", ifs_mod_path.c_str());
     auto start = time();
     vector<Bitmap*> textures;
 
@@ -118,9 +271,12 @@ bool add_images_to_list(string_set &extra_pngs, rapidxml::xml_node<> *texturelis
 
     auto pack_start = time();
     vector<Packer*> packed_textures;
-    if (!pack_textures(textures, packed_textures)) {
-        log_warning("Couldn't pack textures :(");
-        return false;
+    {
+        TraceSpan pack_span("texture packing", ifs_mod_path.c_str());
+        if (!pack_textures(textures, packed_textures)) {
+            log_warning("Couldn't pack textures :(");
+            return false;
+        }
     }
     log_misc("Texture packing %d ms", time() - pack_start);
 
@@ -182,9 +338,9 @@ bool add_images_to_list(string_set &extra_pngs, rapidxml::xml_node<> *texturelis
             image_info.height = texture->height;
 
             auto md5_path = ifs_path + "/tex/" + image_info.name_md5;
-            ifs_textures_mtx.lock();
-            ifs_textures[md5_path] = std::make_shared<image_t>(std::move(image_info));
-            ifs_textures_mtx.unlock();
+            auto entry = std::make_shared<image_t>(std::move(image_info));
+            images.push_back(entry);
+            ifs_textures.insert_or_assign(md5_path, entry);
         }
     }
 
@@ -208,6 +364,8 @@ void parse_texturelist(HookFile &file) {
         return;
     }
 
+    TraceSpan span("parse_texturelist", ifs_mod_path.c_str());
+
     // open the correct file
     auto path_to_open = file.get_path_to_open();
     rapidxml::xml_document<> texturelist;
@@ -223,6 +381,7 @@ void parse_texturelist(HookFile &file) {
     }
 
     auto extra_pngs = list_pngs(ifs_mod_path);
+    vector<std::shared_ptr<image_t>> images;
 
     auto compress = NONE;
     rapidxml::xml_attribute<> *compress_node;
@@ -293,18 +452,24 @@ void parse_texturelist(HookFile &file) {
             extra_pngs.erase(image_info.name);
 
             auto md5_path = ifs_path + "/tex/" + image_info.name_md5;
-            ifs_textures_mtx.lock();
-            ifs_textures[md5_path] = std::make_shared<image_t>(std::move(image_info));
-            ifs_textures_mtx.unlock();
+            auto entry = std::make_shared<image_t>(std::move(image_info));
+            images.push_back(entry);
+            ifs_textures.insert_or_assign(md5_path, entry);
         }
     }
 
     log_verbose("%d added PNGs", extra_pngs.size());
     if (extra_pngs.size() > 0) {
-        if (add_images_to_list(extra_pngs, texturelist_node, ifs_path, ifs_mod_path, compress))
+        if (add_images_to_list(extra_pngs, texturelist_node, ifs_path, ifs_mod_path, compress, images))
             prop_was_rewritten = true;
     }
 
+    update_manifest(ifs_mod_path, images);
+
+    // the game asks for the textures one at a time right after this, so get
+    // them all building now instead of making it wait for each in turn
+    start_ifs_texture_jobs(ifs_mod_path, images);
+
     if (prop_was_rewritten) {
         string outfolder = CACHE_FOLDER + "/" + ifs_mod_path;
         if (!mkdir_p(outfolder)) {
@@ -316,32 +481,152 @@ void parse_texturelist(HookFile &file) {
     }
 }
 
-bool cache_texture(string const&png_path, image_t const&tex) {
-    string cache_path = tex.cache_folder();
-    if (!mkdir_p(cache_path)) {
-        log_warning("Couldn't create texture cache folder");
+// Encoded textures, named by a hash of everything that goes into them. The
+// same png used by several IFS files (fonts, shared UI...) is only encoded
+// once, and each IFS's cache file is a hard link to the blob.
+#define TEXTURE_BLOB_FOLDER (CACHE_FOLDER + "/blobs")
+
+static std::optional<string> texture_blob_path(string const&png_path, image_t const&tex) {
+    // always by contents, mtimes would never match across copies of a png
+    auto png_hash = file_content_hash(png_path.c_str());
+    if (!png_hash) {
+        return std::nullopt;
+    }
+
+    MD5 digest;
+    digest_add_dll_version(digest);
+    digest.add(png_hash->h, sizeof(png_hash->h));
+    digest.add(&tex.format, sizeof(tex.format));
+    digest.add(&tex.compression, sizeof(tex.compression));
+    digest.add(&tex.width, sizeof(tex.width));
+    digest.add(&tex.height, sizeof(tex.height));
+    if (tex.format == DXT5) {
+        digest.add(&config.dxt_quality, sizeof(config.dxt_quality));
+    }
+
+    return TEXTURE_BLOB_FOLDER + "/" + digest.getHash();
+}
+
+// Held while a blob is checked and written, so two IFS files sharing a png
+// don't both encode it
+static std::unordered_map<string, std::shared_ptr<CriticalSectionLock>> texture_blob_locks;
+static CriticalSectionLock texture_blob_locks_mtx;
+
+static std::shared_ptr<CriticalSectionLock> texture_blob_lock(string const&blob) {
+    texture_blob_locks_mtx.lock();
+    auto &lock = texture_blob_locks[blob];
+    if (!lock) {
+        lock = std::make_shared<CriticalSectionLock>();
+    }
+    auto ret = lock;
+    texture_blob_locks_mtx.unlock();
+    return ret;
+}
+
+// Hard link if we can, copy if we can't (FAT32, or the cache being split
+// across drives)
+static bool link_texture_blob(string const&blob, string const&cache_file) {
+    if (CreateHardLinkA(cache_file.c_str(), blob.c_str(), NULL)) {
+        return true;
+    }
+    // never over the top of an existing file, which could be a link to
+    // another blob. cache_texture has already deleted it.
+    if (CopyFileA(blob.c_str(), cache_file.c_str(), TRUE)) {
+        return true;
+    }
+
+    log_warning("Couldn't link texture cache %s: %d", cache_file.c_str(), GetLastError());
+    return false;
+}
+
+// Every cache file that came from a blob has a sidecar naming it. Links share
+// their mtime with the blob and every other link to it, so that can't say
+// whether this one is current, but the name covers everything it was built from.
+static string blob_name_file(string const&cache_file) {
+    return cache_file + ".blob";
+}
+
+static string blob_name(string const&blob) {
+    return blob.substr(blob.find_last_of('/') + 1);
+}
+
+static std::optional<string> read_blob_name(string const&cache_file) {
+    auto f = fopen(blob_name_file(cache_file).c_str(), "rb");
+    if (!f) {
+        return std::nullopt;
+    }
+    char name[64];
+    auto len = fread(name, 1, sizeof(name), f);
+    fclose(f);
+    return string(name, len);
+}
+
+static bool write_blob_name(string const&cache_file, string const&blob) {
+    auto name = blob_name(blob);
+    auto name_file = blob_name_file(cache_file);
+    auto tmp_path = name_file + ".tmp";
+    auto f = fopen(tmp_path.c_str(), "wb");
+    if (!f) {
+        log_warning("Couldn't write %s", name_file.c_str());
+        return false;
+    }
+    bool ok = fwrite(name.c_str(), 1, name.size(), f) == name.size();
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || !MoveFileExA(tmp_path.c_str(), name_file.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        log_warning("Couldn't write %s", name_file.c_str());
+        DeleteFileA(tmp_path.c_str());
         return false;
     }
+    return true;
+}
+
+// Only used when there's no blob (the png couldn't be hashed), with
+// --layered-content-hash. Plain mtimes are cheaper, but don't survive copying
+// the mods (and their cache) somewhere else.
+static CacheHasher texture_cache_hasher(string const&png_path, image_t const&tex) {
+    CacheHasher hasher(tex.cache_file() + ".hashed");
+    auto png = png_path;
+    hasher.add(png);
+    // same as the blob name
+    if (tex.format == DXT5) {
+        hasher.add_bytes(&config.dxt_quality, sizeof(config.dxt_quality));
+    }
+    hasher.finish();
+    return hasher;
+}
+
+static bool texture_cache_fresh(string const&png_path, image_t const&tex) {
+#ifdef ALWAYS_CACHE
+    return false;
+#else
+    auto cache_file = tex.cache_file();
+    auto blob = texture_blob_path(png_path, tex);
+    if (blob) {
+        return read_blob_name(cache_file) == blob_name(*blob) && file_exists(cache_file.c_str());
+    }
+
+    if (config.content_hash) {
+        return texture_cache_hasher(png_path, tex).matches() && file_exists(cache_file.c_str());
+    }
 
-    string cache_file = tex.cache_file();
     auto cache_time = file_time(cache_file.c_str());
     auto png_time = file_time(png_path.c_str());
 
-    // the cache is fresh, don't do the same work twice
-#ifndef ALWAYS_CACHE
-    if (cache_time > 0 && cache_time >= dll_time && cache_time >= png_time) {
-        return true;
-    }
+    return cache_time > 0 && cache_time >= dll_time && cache_time >= png_time;
 #endif
+}
 
-    // make the cache
+static bool encode_texture(string const&png_path, image_t const&tex, string const&out_path) {
     FILE *cache;
 
     unsigned error;
     unsigned char* image;
     unsigned width, height; // TODO use these to check against xml
 
-    error = lodepng_decode32_file(&image, &width, &height, png_path.c_str());
+    {
+        TraceSpan span("png decode", png_path.c_str());
+        error = lodepng_decode32_file(&image, &width, &height, png_path.c_str());
+    }
     if (error) {
         log_warning("can't load png %u: %s\n", error, lodepng_error_text(error));
         return false;
@@ -355,28 +640,25 @@ bool cache_texture(string const&png_path, image_t const&tex) {
     size_t image_size = 4 * width * height;
 
     switch (tex.format) {
-    case ARGB8888REV:
-        for (size_t i = 0; i < image_size; i += 4) {
-            // swap r and b
-            auto tmp = image[i];
-            image[i] = image[i + 2];
-            image[i + 2] = tmp;
-        }
+    case ARGB8888REV: {
+        TraceSpan span("swizzle", png_path.c_str());
+        swizzle_swap_rb(image, image_size);
         break;
+    }
     case DXT5: {
         size_t dxt5_size = image_size / 4;
         unsigned char* dxt5_image = (unsigned char*)malloc(dxt5_size);
-        rygCompress(dxt5_image, image, width, height, 1);
+        {
+            TraceSpan span("dxt", png_path.c_str());
+            dxt_compress(dxt5_image, image, width, height, DXT_FORMAT_DXT5, config.dxt_quality);
+        }
         free(image);
         image = dxt5_image;
         image_size = dxt5_size;
 
         // the data has swapped endianness for every WORD
-        for (size_t i = 0; i < image_size; i += 2) {
-            auto tmp = image[i];
-            image[i] = image[i + 1];
-            image[i + 1] = tmp;
-        }
+        TraceSpan span("swizzle", png_path.c_str());
+        swizzle_swap_words(image, image_size);
 
         /*FILE* f = fopen("dxt_debug.bin", "wb");
         fwrite(dxt5_image, 1, dxt5_size, f);
@@ -388,35 +670,98 @@ bool cache_texture(string const&png_path, image_t const&tex) {
     }
     auto uncompressed_size = image_size;
 
+    // native rather than AVS's cstream, so this works from any thread, before
+    // AVS has even booted
+    vector<uint8_t> compressed;
     if (tex.compression == AVSLZ) {
-        size_t compressed_size;
-        auto compressed = lz_compress(image, image_size, &compressed_size);
+        TraceSpan span("lz compress", png_path.c_str());
+        compressed = lz77_compress(image, image_size, LZ77_FORMAT_AVSLZ);
         free(image);
-        if (compressed == NULL) {
-            log_warning("Couldn't compress");
-            return false;
-        }
-        image = compressed;
-        image_size = compressed_size;
+        image = NULL;
     }
 
-    cache = fopen(cache_file.c_str(), "wb");
+    // written aside and renamed into place, so a crash never leaves a
+    // truncated texture that looks valid
+    TraceSpan span("file write", out_path.c_str());
+    auto temp_path = out_path + ".tmp";
+    cache = fopen(temp_path.c_str(), "wb");
     if (!cache) {
         log_warning("can't open cache for writing");
+        free(image);
         return false;
     }
     if (tex.compression == AVSLZ) {
         uint32_t uncomp_sz = _byteswap_ulong((uint32_t)uncompressed_size);
-        uint32_t comp_sz = _byteswap_ulong((uint32_t)image_size);
+        uint32_t comp_sz = _byteswap_ulong((uint32_t)compressed.size());
         fwrite(&uncomp_sz, 4, 1, cache);
         fwrite(&comp_sz, 4, 1, cache);
+        fwrite(compressed.data(), 1, compressed.size(), cache);
+    } else {
+        fwrite(image, 1, image_size, cache);
     }
-    fwrite(image, 1, image_size, cache);
     fclose(cache);
     free(image);
+
+    if (!MoveFileExA(temp_path.c_str(), out_path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        log_warning("can't move texture into the cache: %d", GetLastError());
+        DeleteFileA(temp_path.c_str());
+        return false;
+    }
+    stats_count(STATS_TEXTURE_BUILT);
     return true;
 }
 
+bool cache_texture(string const&png_path, image_t const&tex) {
+    string cache_path = tex.cache_folder();
+    if (!mkdir_p(cache_path) || !mkdir_p(TEXTURE_BLOB_FOLDER)) {
+        log_warning("Couldn't create texture cache folder");
+        return false;
+    }
+
+    string cache_file = tex.cache_file();
+    TraceSpan span("cache_texture", png_path.c_str());
+
+    // the cache is fresh, don't do the same work twice
+    if (texture_cache_fresh(png_path, tex)) {
+        return true;
+    }
+
+    // the name goes first, so it never vouches for a half-replaced file
+    auto name_file = blob_name_file(cache_file);
+    if (!DeleteFileA(name_file.c_str()) && GetLastError() != ERROR_FILE_NOT_FOUND) {
+        log_warning("Couldn't replace texture cache %s: %d", name_file.c_str(), GetLastError());
+        return false;
+    }
+    // It may be a link to a blob, which must never be written through. If
+    // it's still open somewhere it can't go, so leave it for next time.
+    if (!DeleteFileA(cache_file.c_str()) && GetLastError() != ERROR_FILE_NOT_FOUND) {
+        log_warning("Couldn't replace texture cache %s: %d", cache_file.c_str(), GetLastError());
+        return false;
+    }
+
+    bool ok;
+    auto blob = texture_blob_path(png_path, tex);
+    if (blob) {
+        auto lock = texture_blob_lock(*blob);
+        lock->lock();
+        if (file_exists(blob->c_str())) {
+            log_verbose("%s already encoded, linking %s", png_path.c_str(), blob->c_str());
+            ok = true;
+        } else {
+            ok = encode_texture(png_path, tex, *blob);
+        }
+        ok = ok && link_texture_blob(*blob, cache_file);
+        lock->unlock();
+        ok = ok && write_blob_name(cache_file, *blob);
+    } else {
+        ok = encode_texture(png_path, tex, cache_file);
+        if (ok && config.content_hash) {
+            texture_cache_hasher(png_path, tex).commit();
+        }
+    }
+    return ok;
+}
+
 void parse_afplist(HookFile &file) {
     // get a reasonable base path
     auto ifs_path = file.norm_path;
@@ -467,15 +812,13 @@ void parse_afplist(HookFile &file) {
 
         auto add_mapping = [&](std::string folder, std::string file) {
             auto md5_path = ifs_path + folder + MD5()(file);
-            afp_md5_names[md5_path] = std::make_shared<afp_t>(afp_t {
+            afp_md5_names.insert_or_assign(md5_path, std::make_shared<afp_t>(afp_t {
                 .mod_path = ifs_mod_path + folder + file,
-            });
+            }));
             mapped++;
             // log_info("AFP %s -> %s", md5_path.c_str(), (ifs_mod_path + folder + file).c_str());
         };
 
-        afp_md5_names_mtx.lock();
-
         add_mapping("/afp/", name->value());
         add_mapping("/afp/bsi/", name->value());
 
@@ -485,35 +828,34 @@ void parse_afplist(HookFile &file) {
         while(ss >> index) {
             add_mapping("/geo/", std::string(name->value()) + "_shape" + index);
         }
-
-        afp_md5_names_mtx.unlock();
     }
 
     log_misc("Mapped %d AFP filenames", mapped);
 }
 
+static std::optional<string> find_texture_png(const image_t &tex) {
+    // remove the /tex/, it's nicer to navigate
+    auto png_path = find_first_modfile(tex.ifs_mod_path + "/" + tex.name + ".png");
+    if (!png_path) {
+        // but maybe they used it anyway
+        png_path = find_first_modfile(tex.ifs_mod_path + "/tex/" + tex.name + ".png");
+    }
+    return png_path;
+}
+
 std::optional<std::tuple<std::string, std::shared_ptr<image_t>>> lookup_png_from_md5(HookFile &file) {
-    ifs_textures_mtx.lock();
-    auto tex_search = ifs_textures.find(file.norm_path);
-    if (tex_search == ifs_textures.end()) {
-        ifs_textures_mtx.unlock();
+    auto tex = ifs_textures.find(file.norm_path);
+    if (!tex) {
         return std::nullopt;
     }
 
     //log_misc("Mapped file %s is found!", norm_path.c_str());
-    auto tex = tex_search->second;
-    ifs_textures_mtx.unlock(); // is it safe to unlock this early? Time will tell...
 
-    // remove the /tex/, it's nicer to navigate
-    auto png_path = find_first_modfile(tex->ifs_mod_path + "/" + tex->name + ".png");
-    if (!png_path) {
-        // but maybe they used it anyway
-        png_path = find_first_modfile(tex->ifs_mod_path + "/tex/" + tex->name + ".png");
-        if (!png_path)
-            return std::nullopt;
-    }
+    auto png_path = find_texture_png(**tex);
+    if (!png_path)
+        return std::nullopt;
 
-    return std::make_tuple(*png_path, tex);
+    return std::make_tuple(*png_path, *tex);
 }
 
 void handle_texture(HookFile &file) {
@@ -533,25 +875,192 @@ void handle_texture(HookFile &file) {
     }
 
     log_verbose("Mapped file %s found!", png_path.c_str());
-    if (cache_texture(png_path, *tex)) {
+
+    // if a pre-warm job is building this right now, wait for it instead of
+    // racing it. If it hasn't started yet, we'll just build it ourselves.
+    auto job = find_texture_job(tex->cache_file());
+    if (job) {
+        job->lock.lock();
+    }
+    auto cached = cache_texture(png_path, *tex);
+    if (job) {
+        job->done = true;
+        job->lock.unlock();
+    }
+
+    if (cached) {
         file.mod_path = tex->cache_file();
     }
     return;
 }
 
+// Build each texture on the background pool, unless the game gets to it first.
+// Only the pre-warm is loud about its progress, since it's one big batch.
+static void start_texture_jobs(vector<texture_build_t> &&builds, string what, bool loud) {
+    if (builds.empty()) {
+        return;
+    }
+
+    auto items = std::make_shared<vector<texture_build_t>>(std::move(builds));
+    // the jobs outlive the caller, so they can't point at its strings
+    auto name = std::make_shared<string>(std::move(what));
+    auto remaining = std::make_shared<std::atomic<size_t>>(items->size());
+    auto rebuilt = std::make_shared<std::atomic<size_t>>(0);
+    auto total = items->size();
+    auto progress_step = std::max(total / 10, (size_t)1);
+    auto start = time();
+
+    for (size_t i = 0; i < total; i++) {
+        background_pool().submit([=] {
+            auto &item = (*items)[i];
+
+            item.job->lock.lock();
+            if (!item.job->done) {
+                if (!texture_cache_fresh(item.png_path, item.tex)) {
+                    log_verbose("Pre-building %s", item.png_path.c_str());
+                    cache_texture(item.png_path, item.tex);
+                    (*rebuilt)++;
+                }
+                item.job->done = true;
+            }
+            item.job->lock.unlock();
+
+            auto left = --(*remaining);
+            if (left == 0) {
+                if (loud) {
+                    log_info("%s done: %d textures checked, %d rebuilt in %d ms",
+                        name->c_str(), total, rebuilt->load(), time() - start);
+                } else {
+                    log_verbose("%s done: %d textures checked, %d rebuilt in %d ms",
+                        name->c_str(), total, rebuilt->load(), time() - start);
+                }
+            } else if (loud && left % progress_step == 0) {
+                log_misc("%s: %d/%d", name->c_str(), total - left, total);
+            }
+        });
+    }
+}
+
+static void start_ifs_texture_jobs(const string &ifs_mod_path, const vector<std::shared_ptr<image_t>> &images) {
+    vector<std::tuple<string, std::shared_ptr<image_t>>> modded;
+    for (auto &tex : images) {
+        if (tex->format == UNSUPPORTED_FORMAT || tex->compression == UNSUPPORTED_COMPRESS) {
+            continue;
+        }
+        auto png_path = find_texture_png(*tex);
+        if (png_path) {
+            modded.emplace_back(*png_path, tex);
+        }
+    }
+
+    vector<texture_build_t> builds;
+    texture_jobs_mtx.lock();
+    for (auto &[png_path, tex] : modded) {
+        auto job = new_texture_job(tex->cache_file());
+        if (job) {
+            builds.push_back(texture_build_t {
+                .png_path = png_path,
+                .tex = *tex,
+                .job = job,
+            });
+        }
+    }
+    texture_jobs_mtx.unlock();
+
+    log_verbose("Building %d textures for %s in the background", builds.size(), ifs_mod_path.c_str());
+    start_texture_jobs(std::move(builds), ifs_mod_path, false);
+}
+
+void start_texture_prewarm(void) {
+    auto start = time();
+    auto ifs_folders = find_all_ifs_modfolders();
+    vector<texture_build_t> prewarm_items;
+
+    texture_jobs_mtx.lock();
+    for (auto &ifs_mod_path : ifs_folders) {
+        for (auto &[name, line] : load_manifest(ifs_mod_path)) {
+            auto tex = parse_manifest_line(line, ifs_mod_path);
+            if (!tex || tex->format == UNSUPPORTED_FORMAT || tex->compression == UNSUPPORTED_COMPRESS) {
+                continue;
+            }
+
+            auto png_path = find_texture_png(*tex);
+            if (!png_path)
+                continue;
+
+            auto job = new_texture_job(tex->cache_file());
+            if (!job)
+                continue;
+            prewarm_items.push_back(texture_build_t {
+                .png_path = *png_path,
+                .tex = std::move(*tex),
+                .job = job,
+            });
+        }
+    }
+    texture_jobs_mtx.unlock();
+
+    log_misc("Texture pre-warm: %d modded textures found in %d IFS folders (%d ms)",
+        prewarm_items.size(), ifs_folders.size(), time() - start);
+    start_texture_jobs(std::move(prewarm_items), "Texture pre-warm", true);
+}
+
+size_t cache_all_textures(void) {
+    vector<std::shared_ptr<image_t>> textures;
+    ifs_textures.for_each([&](const string&, const std::shared_ptr<image_t> &tex) {
+        if (tex->format != UNSUPPORTED_FORMAT && tex->compression != UNSUPPORTED_COMPRESS) {
+            textures.push_back(tex);
+        }
+    });
+
+    vector<std::tuple<string, std::shared_ptr<image_t>>> items;
+    for (auto &tex : textures) {
+        auto png_path = find_texture_png(*tex);
+        if (png_path) {
+            items.emplace_back(*png_path, tex);
+        }
+    }
+
+    auto total = items.size();
+    auto progress_step = std::max(total / 20, (size_t)1);
+    std::atomic<size_t> finished = 0;
+    std::atomic<size_t> built = 0;
+
+    background_pool().parallel_for(total, [&](size_t i) {
+        auto &[png_path, tex] = items[i];
+        // a pre-warm may still be going
+        auto job = find_texture_job(tex->cache_file());
+        if (job) {
+            job->lock.lock();
+        }
+        if (cache_texture(png_path, *tex)) {
+            built++;
+        }
+        if (job) {
+            job->done = true;
+            job->lock.unlock();
+        }
+
+        auto done = ++finished;
+        if (done % progress_step == 0 || done == total) {
+            log_info("Textures: %d/%d", done, total);
+        }
+    });
+
+    if (built != total) {
+        log_warning("%d of %d textures couldn't be cached", total - built, total);
+    }
+    return built;
+}
+
 std::optional<std::string> lookup_afp_from_md5(HookFile &file) {
-    afp_md5_names_mtx.lock();
-    auto afp_search = afp_md5_names.find(file.norm_path);
-    if (afp_search == afp_md5_names.end()) {
-        afp_md5_names_mtx.unlock();
+    auto afp = afp_md5_names.find(file.norm_path);
+    if (!afp) {
         return std::nullopt;
     }
 
     //log_misc("Mapped file %s is found!", norm_path.c_str());
-    auto afp = afp_search->second;
-    afp_md5_names_mtx.unlock(); // is it safe to unlock this early? Time will tell...
-
-    return find_first_modfile(afp->mod_path);
+    return find_first_modfile((*afp)->mod_path);
 }
 
 void handle_afp(HookFile &file) {
@@ -565,6 +1074,7 @@ void handle_afp(HookFile &file) {
 }
 
 void merge_xmls(HookFile &file) {
+    TraceSpan span("merge_xmls", file.norm_path.c_str());
     auto start = time();
     // initialize since we're GOTO-ing like naughty people
     string out;
@@ -628,6 +1138,7 @@ void merge_xmls(HookFile &file) {
     rapidxml_dump_to_file(out, merged_xml);
     cache_hasher.commit();
     file.mod_path = out;
+    stats_count(STATS_XML_MERGED);
 
     log_misc("Merge took %d ms", time() - start);
 }
@@ -9,6 +9,14 @@ void handle_afp(HookFile &file);
 void parse_texturelist(HookFile &file);
 void parse_afplist(HookFile &file);
 void merge_xmls(HookFile &file);
+// Load the texture manifests saved by previous boots, and start building every
+// modded texture they list in the background. Doesn't need AVS, but must be
+// called before the hooks are enabled.
+void start_texture_prewarm(void);
+// Build the cache of every modded texture in the texturelists parsed so far,
+// on every core. Returns how many are now cached. Meant for offline baking.
+size_t cache_all_textures(void);
+
 // only exported to test the MD5 lookup machinery
 struct image;
 std::optional<std::tuple<std::string, std::shared_ptr<struct image>>> lookup_png_from_md5(HookFile &file);
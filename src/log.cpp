@@ -105,6 +105,13 @@ void stdout_log_body_misc(const char *module, const char *fmt, ...) {
     va_end(args);
 }
 
+void log_to_logfile(void) {
+    imp_log_body_fatal = default_log_body_fatal;
+    imp_log_body_warning = default_log_body_warning;
+    imp_log_body_info = default_log_body_info;
+    imp_log_body_misc = default_log_body_misc;
+}
+
 void log_to_stdout(void) {
     imp_log_body_fatal = stdout_log_body_fatal;
     imp_log_body_warning = stdout_log_body_warning;
@@ -15,6 +15,9 @@
 
 // for the playpen
 void log_to_stdout(void);
+// Stop logging through AVS, for once it may have shut down. Goes to
+// --layered-logfile, or ifs_hook.log.
+void log_to_logfile(void);
 
 typedef void (*log_formatter_t)(const char *module, const char *fmt, ...);
 
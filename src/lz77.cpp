@@ -0,0 +1,310 @@
+#include "lz77.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+
+using std::vector;
+
+// The window starts out as 4096 zeros, and matches may reach back into them,
+// so the matcher works on a copy of the input with those zeros prepended
+#define LZ77_WINDOW 4096
+#define LZ77_MIN_MATCH 3
+#define LZ77_MAX_MATCH 18
+#define LZ77_HASH_BITS 15
+
+// How each format packs a match. Distances are always counted back from the
+// current output position.
+struct TexbinLayout {
+    static const uint32_t max_distance = LZ77_WINDOW;
+    static const bool end_marker = false;
+
+    // the window write position starts at 4078
+    static inline void put_match(uint8_t *out, size_t out_pos, uint32_t distance, uint32_t len) {
+        auto window_pos = (uint32_t)(out_pos + 4078 - distance) & 0xfff;
+        out[0] = (uint8_t)window_pos;
+        out[1] = (uint8_t)(((window_pos >> 4) & 0xf0) | (len - LZ77_MIN_MATCH));
+    }
+
+    // false if this is an end marker
+    static inline bool get_match(const uint8_t *in, size_t out_pos, uint32_t &distance, uint32_t &len) {
+        uint32_t window_pos = ((in[1] & 0xf0) << 4) | in[0];
+        distance = (uint32_t)(out_pos + 4078 - window_pos) & 0xfff;
+        // reading from the position about to be written is 4096 back
+        if (distance == 0) {
+            distance = LZ77_WINDOW;
+        }
+        len = (in[1] & 0x0f) + LZ77_MIN_MATCH;
+        return true;
+    }
+};
+
+struct AvslzLayout {
+    // distance 0 is the end marker
+    static const uint32_t max_distance = LZ77_WINDOW - 1;
+    static const bool end_marker = true;
+
+    static inline void put_match(uint8_t *out, size_t, uint32_t distance, uint32_t len) {
+        uint16_t word = (uint16_t)((distance << 4) | (len - LZ77_MIN_MATCH));
+        out[0] = word >> 8;
+        out[1] = word & 0xff;
+    }
+
+    static inline bool get_match(const uint8_t *in, size_t, uint32_t &distance, uint32_t &len) {
+        uint16_t word = (in[0] << 8) | in[1];
+        distance = word >> 4;
+        len = (word & 0x0f) + LZ77_MIN_MATCH;
+        return distance != 0;
+    }
+};
+
+typedef struct {
+    // how many candidates to try per position
+    uint32_t max_chain;
+    // stop searching once a match this long is found
+    uint32_t good_len;
+    // check if the next byte starts a better match before taking this one
+    bool lazy;
+} lz77_params_t;
+
+static const lz77_params_t lz77_levels[] = {
+    // LZ77_LEVEL_FAST
+    {4, 8, false},
+    // LZ77_LEVEL_DEFAULT
+    {32, LZ77_MAX_MATCH, true},
+    // LZ77_LEVEL_MAX
+    {LZ77_WINDOW, LZ77_MAX_MATCH, true},
+};
+
+static inline uint32_t lz77_hash(const uint8_t *p) {
+    uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - LZ77_HASH_BITS);
+}
+
+class Lz77Matcher {
+    public:
+    Lz77Matcher(const uint8_t *buf, size_t len, const lz77_params_t &params, uint32_t max_distance)
+        : buf(buf)
+        , len(len)
+        , params(params)
+        , max_distance(max_distance)
+        , head(1 << LZ77_HASH_BITS, -1)
+        , prev(LZ77_WINDOW, -1)
+    {}
+
+    void insert(size_t pos) {
+        if (pos + LZ77_MIN_MATCH > len) {
+            return;
+        }
+        auto h = lz77_hash(&buf[pos]);
+        prev[pos % LZ77_WINDOW] = head[h];
+        head[h] = (int32_t)pos;
+    }
+
+    // longest match for pos, returns the length (0 if none) and sets distance
+    uint32_t find(size_t pos, uint32_t &distance) {
+        if (pos + LZ77_MIN_MATCH > len) {
+            return 0;
+        }
+
+        auto max_len = (uint32_t)std::min((size_t)LZ77_MAX_MATCH, len - pos);
+        auto limit = pos > max_distance ? pos - max_distance : 0;
+        auto target = &buf[pos];
+        uint32_t best = 0;
+
+        auto candidate = head[lz77_hash(target)];
+        for (uint32_t chain = params.max_chain;
+                candidate >= (int64_t)limit && chain > 0;
+                chain--, candidate = prev[candidate % LZ77_WINDOW]) {
+            auto match = &buf[candidate];
+            // quick reject: it has to beat what we have
+            if (match[best] != target[best] || match[0] != target[0]) {
+                continue;
+            }
+
+            uint32_t match_len = 0;
+            while (match_len < max_len && match[match_len] == target[match_len]) {
+                match_len++;
+            }
+
+            if (match_len > best) {
+                best = match_len;
+                distance = (uint32_t)(pos - candidate);
+                if (best >= params.good_len || best == max_len) {
+                    break;
+                }
+            }
+        }
+
+        return best >= LZ77_MIN_MATCH ? best : 0;
+    }
+
+    private:
+    const uint8_t *buf;
+    size_t len;
+    const lz77_params_t &params;
+    uint32_t max_distance;
+    // most recent position for each hash, and the one before each position
+    vector<int32_t> head;
+    vector<int32_t> prev;
+};
+
+template<typename Layout>
+static vector<uint8_t> compress(const uint8_t *data, size_t len, lz77_level level) {
+    auto &params = lz77_levels[level];
+
+    vector<uint8_t> buf(LZ77_WINDOW + len, 0);
+    if (len) {
+        memcpy(&buf[LZ77_WINDOW], data, len);
+    }
+
+    Lz77Matcher matcher(&buf[0], buf.size(), params, Layout::max_distance);
+    for (size_t i = 0; i < LZ77_WINDOW; i++) {
+        matcher.insert(i);
+    }
+
+    // worst case, every byte is a literal with a flag bit each, plus the end
+    // marker and its flag byte
+    vector<uint8_t> output(len + (len + 7) / 8 + 3);
+    auto out = &output[0];
+    uint8_t *flags = NULL;
+    uint32_t flag_bit = 8;
+
+    auto next_token = [&]() {
+        if (flag_bit == 8) {
+            flags = out++;
+            *flags = 0;
+            flag_bit = 0;
+        }
+        return 1 << flag_bit++;
+    };
+
+    size_t pos = LZ77_WINDOW;
+    uint32_t distance = 0;
+    uint32_t match_len = matcher.find(pos, distance);
+    while (pos < buf.size()) {
+        // a match starting on the next byte might be longer, in which case
+        // this byte is better off as a literal
+        uint32_t next_distance = 0;
+        uint32_t next_len = 0;
+        matcher.insert(pos);
+        if (params.lazy && match_len && match_len < LZ77_MAX_MATCH) {
+            next_len = matcher.find(pos + 1, next_distance);
+            if (next_len <= match_len) {
+                next_len = 0;
+            }
+        }
+
+        auto token = next_token();
+        if (match_len && !next_len) {
+            Layout::put_match(out, pos - LZ77_WINDOW, distance, match_len);
+            out += 2;
+
+            for (size_t i = pos + 1; i < pos + match_len; i++) {
+                matcher.insert(i);
+            }
+            pos += match_len;
+            match_len = matcher.find(pos, distance);
+        } else {
+            *flags |= token;
+            *out++ = buf[pos];
+            pos++;
+            if (next_len) {
+                match_len = next_len;
+                distance = next_distance;
+            } else {
+                match_len = matcher.find(pos, distance);
+            }
+        }
+    }
+
+    if (Layout::end_marker) {
+        next_token();
+        *out++ = 0;
+        *out++ = 0;
+    }
+
+    output.resize(out - &output[0]);
+    return output;
+}
+
+template<typename Layout>
+static vector<uint8_t> decompress(const uint8_t *comp, size_t comp_len, size_t out_len) {
+    vector<uint8_t> out(out_len);
+    size_t out_pos = 0;
+    size_t comp_i = 0;
+
+    while (comp_i < comp_len && out_pos < out_len) {
+        uint8_t flags = comp[comp_i++];
+
+        for (int i = 0; i < 8 && out_pos < out_len; i++, flags >>= 1) {
+            if (flags & 1) {
+                if (comp_i >= comp_len) {
+                    goto done;
+                }
+                out[out_pos++] = comp[comp_i++];
+                continue;
+            }
+
+            if (comp_i + 2 > comp_len) {
+                goto done;
+            }
+            uint32_t distance, len;
+            if (!Layout::get_match(&comp[comp_i], out_pos, distance, len)) {
+                goto done;
+            }
+            comp_i += 2;
+
+            len = (uint32_t)std::min((size_t)len, out_len - out_pos);
+            auto dst = &out[out_pos];
+
+            // the window starts zeroed, and out is already zero filled
+            if (distance > out_pos) {
+                auto zeros = (uint32_t)std::min((size_t)len, distance - out_pos);
+                dst += zeros;
+                out_pos += zeros;
+                len -= zeros;
+            }
+
+            if (len == 0) {
+                continue;
+            }
+            auto src = dst - distance;
+            if (distance >= len) {
+                memcpy(dst, src, len);
+            } else if (distance == 1) {
+                memset(dst, *src, len);
+            } else {
+                // overlapping, so a run that repeats itself
+                for (uint32_t j = 0; j < len; j++) {
+                    dst[j] = src[j];
+                }
+            }
+            out_pos += len;
+        }
+    }
+
+done:
+    out.resize(out_pos);
+    return out;
+}
+
+vector<uint8_t> lz77_compress(const uint8_t *data, size_t len, lz77_format format, lz77_level level) {
+    switch (format) {
+    case LZ77_FORMAT_TEXBIN:
+        return compress<TexbinLayout>(data, len, level);
+    case LZ77_FORMAT_AVSLZ:
+    default:
+        return compress<AvslzLayout>(data, len, level);
+    }
+}
+
+vector<uint8_t> lz77_decompress(const uint8_t *comp, size_t comp_len, size_t out_len, lz77_format format) {
+    switch (format) {
+    case LZ77_FORMAT_TEXBIN:
+        return decompress<TexbinLayout>(comp, comp_len, out_len);
+    case LZ77_FORMAT_AVSLZ:
+    default:
+        return decompress<AvslzLayout>(comp, comp_len, out_len);
+    }
+}
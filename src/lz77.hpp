@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// The LZSS variant konami uses everywhere: a 4KiB window that starts out
+// zeroed, flag bytes (LSB first, 1 = literal byte, 0 = 2 byte match) and
+// matches of 3-18 bytes. The only difference between formats is how a match is
+// packed into its 2 bytes.
+enum lz77_format {
+    // window position, low 8 bits in the first byte, high 4 bits in the top of
+    // the second, length in the bottom. No end marker.
+    LZ77_FORMAT_TEXBIN,
+    // big endian (distance << 4 | length). A 0 word marks the end.
+    LZ77_FORMAT_AVSLZ,
+};
+
+enum lz77_level {
+    LZ77_LEVEL_FAST,
+    LZ77_LEVEL_DEFAULT,
+    // much slower, for when size matters more than time
+    LZ77_LEVEL_MAX,
+};
+
+// Just the compressed stream, no length headers
+std::vector<uint8_t> lz77_compress(const uint8_t *data, size_t len, lz77_format format, lz77_level level = LZ77_LEVEL_DEFAULT);
+// Stops after out_len bytes, or early if the input runs out (or hits an AVSLZ
+// end marker), so the result may be shorter than asked for
+std::vector<uint8_t> lz77_decompress(const uint8_t *comp, size_t comp_len, size_t out_len, lz77_format format);
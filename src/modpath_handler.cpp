@@ -1,6 +1,9 @@
 #include <windows.h>
 #include <algorithm>
+#include <atomic>
+#include <map>
 #include <set>
+#include <unordered_map>
 
 #include "ramfs_demangler.h"
 
@@ -9,19 +12,70 @@
 #include "log.hpp"
 #include "utils.hpp"
 #include "avs.h"
+#include "hook.h"
 #include "winxp_mutex.hpp"
+#include "thread_pool.hpp"
 
 using std::nullopt;
 
+typedef struct {
+    uint64_t size;
+    uint64_t mtime;
+} file_attribs_t;
+
 typedef struct {
     std::string name;
-    std::set<string, CaseInsensitiveCompare> contents;
+    // every file and folder in the mod, relative, with folders ending in "/".
+    // Folders have no attributes
+    std::map<string, file_attribs_t, CaseInsensitiveCompare> contents;
+    // every folder in the mod (relative, with trailing "/", "" is the root) and
+    // its last write time. Adding, removing or renaming anything updates the
+    // time of the folder it's in, so these are enough to validate `contents`.
+    std::vector<std::pair<string, uint64_t>> folder_times;
+    bool from_index;
 } mod_contents_t;
 
-std::vector<mod_contents_t> cached_mods;
+// mod folders in priority order, only valid outside of developer mode
+static std::vector<string> cached_mods;
+
+// Every file/folder provided by any mod, pre-resolved at cache time so a lookup
+// is a single hash probe no matter how many mods are loaded. Keys are
+// normalised paths (folders keep their trailing "/"), compared case
+// insensitively. Values are the on-disk paths of every mod providing that path,
+// in priority order - so the winner is always the first one.
+static std::unordered_map<string, vector<string>, CaseInsensitiveHash, CaseInsensitiveEqual> mod_overlay;
+
+// Attributes of every file in every mod, keyed by on-disk path (as returned by
+// find_first_modfile), so cache freshness checks don't have to touch the disk.
+// Only valid outside of developer mode.
+struct cached_attribs_t {
+    uint64_t size;
+    uint64_t mtime;
+    // False if it came from the mod index. An unchanged folder proves the file
+    // is still there, but not that it wasn't edited in place, so it's checked
+    // once on first use. Never goes back to false, so once it's set the
+    // attributes can be read without locking.
+    std::atomic<bool> verified;
+
+    cached_attribs_t(file_attribs_t attribs, bool verified)
+        : size(attribs.size)
+        , mtime(attribs.mtime)
+        , verified(verified)
+    {}
+};
+static std::unordered_map<string, cached_attribs_t, CaseInsensitiveHash, CaseInsensitiveEqual> mod_file_attribs;
+static CriticalSectionLock mod_file_attribs_lock;
+
+static inline uint64_t filetime_u64(const FILETIME &time) {
+    ULARGE_INTEGER result;
+    result.LowPart = time.dwLowDateTime;
+    result.HighPart = time.dwHighDateTime;
+    return result.QuadPart;
+}
 
-std::set<string, CaseInsensitiveCompare> walk_dir(const string &path, const string &root) {
-    std::set<string, CaseInsensitiveCompare> result;
+static void walk_dir(const string &path, const string &root, mod_contents_t &mod) {
+    // taken before listing, so anything added mid-walk invalidates the index
+    mod.folder_times.emplace_back(root, folder_time(path.c_str()));
 
     WIN32_FIND_DATAA ffd;
     auto contents = FindFirstFileA((path + "/*").c_str(), &ffd);
@@ -34,53 +88,462 @@ std::set<string, CaseInsensitiveCompare> walk_dir(const string &path, const stri
             }
 
             string result_path;
+            file_attribs_t attribs = {0, 0};
             if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
                 // sanity check a common mistake
                 if (root == "" && !strcasecmp(ffd.cFileName, "data")) {
                     log_warning("\"data\" folder detected in mod root. Move all files inside to the mod root, or it will not work");
                 }
                 result_path = root + ffd.cFileName + "/";
-                log_verbose("  %s", result_path.c_str());
-                auto subdir_walk = walk_dir(path + "/" + ffd.cFileName, result_path);
-                result.insert(subdir_walk.begin(), subdir_walk.end());
+                walk_dir(path + "/" + ffd.cFileName, result_path, mod);
             }
             else {
                 result_path = root + ffd.cFileName;
-                log_verbose("  %s", result_path.c_str());
+                // free with the listing, and saves opening each file later
+                attribs.size = ((uint64_t)ffd.nFileSizeHigh << 32) | ffd.nFileSizeLow;
+                attribs.mtime = filetime_u64(ffd.ftLastWriteTime);
             }
-            result.insert(result_path);
+            mod.contents.emplace(result_path, attribs);
         } while (FindNextFileA(contents, &ffd) != 0);
 
         FindClose(contents);
     }
+}
+
+// Persisted result of the last walk, so an unchanged mods folder can be loaded
+// with one read instead of thousands of FindNextFile calls. Also invalidated by
+// DLL updates, in case the format changes.
+#define MOD_INDEX_FILE (CACHE_FOLDER + "/mod_index.bin")
+#define MOD_INDEX_MAGIC "LFSINDX2"
+
+static void index_write_u32(FILE *f, uint32_t val) {
+    fwrite(&val, sizeof(val), 1, f);
+}
+
+static void index_write_u64(FILE *f, uint64_t val) {
+    fwrite(&val, sizeof(val), 1, f);
+}
 
-    return result;
+static void index_write_str(FILE *f, const string &str) {
+    index_write_u32(f, (uint32_t)str.length());
+    fwrite(str.c_str(), 1, str.length(), f);
+}
+
+class IndexReader {
+    public:
+    IndexReader(const vector<uint8_t> &data)
+        : data(data)
+    {}
+
+    bool ok = true;
+
+    bool magic(const char *expected) {
+        auto len = strlen(expected);
+        if (len > data.size() - pos || memcmp(&data[pos], expected, len)) {
+            return false;
+        }
+        pos += len;
+        return true;
+    }
+
+    uint32_t u32() {
+        uint32_t ret = 0;
+        read(&ret, sizeof(ret));
+        return ret;
+    }
+
+    uint64_t u64() {
+        uint64_t ret = 0;
+        read(&ret, sizeof(ret));
+        return ret;
+    }
+
+    string str() {
+        auto len = u32();
+        if (len > data.size() - pos) {
+            ok = false;
+            return "";
+        }
+        string ret((const char*)&data[pos], len);
+        pos += len;
+        return ret;
+    }
+
+    private:
+    const vector<uint8_t> &data;
+    size_t pos = 0;
+
+    void read(void *dest, size_t len) {
+        if (len > data.size() - pos) {
+            ok = false;
+            return;
+        }
+        memcpy(dest, &data[pos], len);
+        pos += len;
+    }
+};
+
+static std::unordered_map<string, mod_contents_t> load_mod_index(void) {
+    std::unordered_map<string, mod_contents_t> ret;
+
+    auto f = fopen(MOD_INDEX_FILE.c_str(), "rb");
+    if (!f) {
+        return ret;
+    }
+    fseek(f, 0, SEEK_END);
+    auto len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    vector<uint8_t> data(len > 0 ? len : 0);
+    auto read = fread(data.data(), 1, data.size(), f);
+    fclose(f);
+
+    IndexReader r(data);
+    if (read != data.size() || !r.magic(MOD_INDEX_MAGIC)) {
+        return ret;
+    }
+
+    if (r.u64() != dll_time) {
+        log_verbose("Mod index is from a different DLL, ignoring");
+        return ret;
+    }
+
+    auto mod_count = r.u32();
+    for (uint32_t i = 0; i < mod_count && r.ok; i++) {
+        mod_contents_t mod;
+        mod.name = r.str();
+        mod.from_index = true;
+
+        auto folder_count = r.u32();
+        for (uint32_t j = 0; j < folder_count && r.ok; j++) {
+            auto folder = r.str();
+            mod.folder_times.emplace_back(folder, r.u64());
+        }
+
+        auto item_count = r.u32();
+        for (uint32_t j = 0; j < item_count && r.ok; j++) {
+            auto item = r.str();
+            file_attribs_t attribs;
+            attribs.size = r.u64();
+            attribs.mtime = r.u64();
+            mod.contents.emplace_hint(mod.contents.end(), std::move(item), attribs);
+        }
+
+        ret[mod.name] = std::move(mod);
+    }
+
+    if (!r.ok) {
+        log_warning("Mod index is corrupt, ignoring");
+        ret.clear();
+    }
+
+    return ret;
+}
+
+static void save_mod_index(const vector<mod_contents_t> &mods) {
+    if (!mkdir_p(CACHE_FOLDER)) {
+        log_warning("Couldn't create cache folder, mod index not saved");
+        return;
+    }
+
+    // write then rename, so a crash can't leave a truncated index
+    auto tmp_path = MOD_INDEX_FILE + ".tmp";
+    auto f = fopen(tmp_path.c_str(), "wb");
+    if (!f) {
+        log_warning("Couldn't write mod index");
+        return;
+    }
+
+    fwrite(MOD_INDEX_MAGIC, 1, strlen(MOD_INDEX_MAGIC), f);
+    index_write_u64(f, dll_time);
+    index_write_u32(f, (uint32_t)mods.size());
+    for (auto &mod : mods) {
+        index_write_str(f, mod.name);
+        index_write_u32(f, (uint32_t)mod.folder_times.size());
+        for (auto &[folder, mtime] : mod.folder_times) {
+            index_write_str(f, folder);
+            index_write_u64(f, mtime);
+        }
+        index_write_u32(f, (uint32_t)mod.contents.size());
+        for (auto &[item, attribs] : mod.contents) {
+            index_write_str(f, item);
+            index_write_u64(f, attribs.size);
+            index_write_u64(f, attribs.mtime);
+        }
+    }
+
+    auto ok = !ferror(f);
+    fclose(f);
+    if (!ok || !MoveFileExA(tmp_path.c_str(), MOD_INDEX_FILE.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        log_warning("Couldn't write mod index");
+        DeleteFileA(tmp_path.c_str());
+    }
+}
+
+static bool mod_index_valid(const mod_contents_t &mod) {
+    if (mod.folder_times.empty()) {
+        return false;
+    }
+
+    for (auto &[folder, mtime] : mod.folder_times) {
+        auto path = mod.name;
+        if (!folder.empty()) {
+            path += "/" + folder.substr(0, folder.length() - 1);
+        }
+        if (folder_time(path.c_str()) != mtime) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Negative lookup filter: a bloom filter over every path any mod provides, so
+// the hooks can reject files no mod could possibly touch without allocating or
+// locking. Paths are hashed case-folded with "_ifs" treated as ".ifs", so an IFS
+// and its mod folder are the same key. False positives just fall back to the
+// full lookup.
+static vector<uint32_t> negative_filter;
+static uint32_t negative_filter_mask;
+
+#define FILTER_HASHES 4
+// 16 bits per entry with 4 hashes is a ~0.25% false positive rate
+#define FILTER_BITS_PER_ENTRY 16
+
+// FNV-1a 64, consumed one canonical character at a time
+static inline void filter_hash_char(uint64_t &hash, char c) {
+    hash ^= (uint8_t)c;
+    hash *= 1099511628211ull;
+}
+
+static inline bool ifs_at(std::string_view path, size_t i) {
+    return i + 3 < path.length() &&
+        (path[i] == '.' || path[i] == '_') &&
+        tolower((uint8_t)path[i + 1]) == 'i' &&
+        tolower((uint8_t)path[i + 2]) == 'f' &&
+        tolower((uint8_t)path[i + 3]) == 's';
+}
+
+static inline bool bin_at(std::string_view path, size_t i) {
+    return i + 3 < path.length() &&
+        path[i] == '.' &&
+        tolower((uint8_t)path[i + 1]) == 'b' &&
+        tolower((uint8_t)path[i + 2]) == 'i' &&
+        tolower((uint8_t)path[i + 3]) == 'n';
+}
+
+static inline char filter_canonical_char(std::string_view path, size_t i) {
+    return ifs_at(path, i) ? '.' : (char)tolower((uint8_t)path[i]);
+}
+
+static void filter_set(uint64_t hash) {
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    for (uint32_t i = 0; i < FILTER_HASHES; i++) {
+        auto bit = (h1 + i * h2) & negative_filter_mask;
+        negative_filter[bit / 32] |= 1u << (bit % 32);
+    }
+}
+
+static bool filter_test(uint64_t hash) {
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    for (uint32_t i = 0; i < FILTER_HASHES; i++) {
+        auto bit = (h1 + i * h2) & negative_filter_mask;
+        if (!(negative_filter[bit / 32] & (1u << (bit % 32)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64_t filter_hash(std::string_view path) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < path.length(); i++) {
+        filter_hash_char(hash, filter_canonical_char(path, i));
+    }
+    return hash;
+}
+
+static void build_negative_filter(void) {
+    size_t bits = 64;
+    while (bits < mod_overlay.size() * 2 * FILTER_BITS_PER_ENTRY) {
+        bits <<= 1;
+    }
+    negative_filter.assign(bits / 32, 0);
+    negative_filter_mask = (uint32_t)(bits - 1);
+
+    for (auto &[item, _providers] : mod_overlay) {
+        std::string_view path = item;
+        // folders are matched without their trailing slash
+        if (path.ends_with('/')) {
+            path.remove_suffix(1);
+        }
+        filter_set(filter_hash(path));
+
+        // music_db.merged.xml must let music_db.xml through
+        if (string_find_icase(item, ".merged.xml") != string::npos) {
+            auto unmerged = item;
+            string_replace(unmerged, ".merged.xml", ".xml");
+            if (unmerged.ends_with('/')) {
+                unmerged.pop_back();
+            }
+            filter_set(filter_hash(unmerged));
+        }
+    }
+}
+
+bool may_be_modded(std::string_view norm_path) {
+    // nothing to filter against in developer mode, mods can appear at any time
+    if (config.developer_mode || negative_filter.empty()) {
+        return true;
+    }
+
+    // The file itself, plus every IFS it lives inside, since the texturelist,
+    // afplist and md5-named textures/afps are all redirected by the IFS' mod
+    // folder rather than a file of the same name
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < norm_path.length(); i++) {
+        filter_hash_char(hash, filter_canonical_char(norm_path, i));
+        if (i >= 3 && ifs_at(norm_path, i - 3) && filter_test(hash)) {
+            return true;
+        }
+    }
+    if (filter_test(hash)) {
+        return true;
+    }
+
+    // texbins are modded by a folder of the same name without the .bin
+    if (norm_path.length() >= 4 && bin_at(norm_path, norm_path.length() - 4)) {
+        hash = 14695981039346656037ull;
+        for (size_t i = 0; i < norm_path.length(); i++) {
+            if (bin_at(norm_path, i)) {
+                i += 3;
+                continue;
+            }
+            filter_hash_char(hash, filter_canonical_char(norm_path, i));
+        }
+        if (filter_test(hash)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool mod_file_attribs_cached(const char *path, uint64_t &size, uint64_t &mtime) {
+    if (config.developer_mode || mod_file_attribs.empty()) {
+        return false;
+    }
+
+    auto found = mod_file_attribs.find(path);
+    if (found == mod_file_attribs.end()) {
+        return false;
+    }
+
+    auto &attribs = found->second;
+    if (!attribs.verified.load(std::memory_order_acquire)) {
+        mod_file_attribs_lock.lock();
+        if (!attribs.verified.load(std::memory_order_relaxed)) {
+            WIN32_FILE_ATTRIBUTE_DATA data;
+            if (GetFileAttributesExA(path, GetFileExInfoStandard, &data)) {
+                attribs.size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+                attribs.mtime = filetime_u64(data.ftLastWriteTime);
+            } else {
+                // deleted since the index was made, report what the disk says
+                attribs.size = attribs.mtime = 0;
+            }
+            attribs.verified.store(true, std::memory_order_release);
+        }
+        mod_file_attribs_lock.unlock();
+    }
+
+    size = attribs.size;
+    mtime = attribs.mtime;
+    return true;
 }
 
 void cache_mods(void) {
+    auto start = time();
+
     // this is a bit hacky
     bool devmode = config.developer_mode;
     config.developer_mode = true;
     auto avail_mods = available_mods();
     config.developer_mode = devmode;
 
-    for (auto &dir : avail_mods) {
-        log_verbose("Walking %s", dir.c_str());
-        mod_contents_t mod;
+    cached_mods.clear();
+    mod_overlay.clear();
+    mod_file_attribs.clear();
+
+    auto index = load_mod_index();
+    vector<mod_contents_t> mods(avail_mods.size());
+
+    // one mod per worker, either checking its indexed folder times or walking it
+    background_pool().parallel_for(avail_mods.size(), [&](size_t i) {
+        auto &dir = avail_mods[i];
+        auto &mod = mods[i];
+
+        auto indexed = index.find(dir);
+        if (indexed != index.end() && mod_index_valid(indexed->second)) {
+            mod = std::move(indexed->second);
+            return;
+        }
+
         mod.name = dir;
+        mod.from_index = false;
         // even in developer mode we want to walk the mods directory for effective logging
-        mod.contents = walk_dir(dir, "");
+        walk_dir(dir, "", mod);
+    });
+
+    size_t walked = 0;
+    for (auto &mod : mods) {
+        if (mod.from_index) {
+            log_verbose("Walking %s (unchanged, using index)", mod.name.c_str());
+        } else {
+            log_verbose("Walking %s", mod.name.c_str());
+            walked++;
+        }
+        for (auto &[item, _attribs] : mod.contents) {
+            log_verbose("  %s", item.c_str());
+        }
+
         if (!config.developer_mode) {
-            cached_mods.push_back(mod);
+            for (auto &[item, attribs] : mod.contents) {
+                auto path = mod.name + "/" + item;
+                if (!item.ends_with('/')) {
+                    mod_file_attribs.try_emplace(path, attribs, !mod.from_index);
+                }
+                mod_overlay[item].push_back(std::move(path));
+            }
+            cached_mods.push_back(mod.name);
         }
     }
+
+    // only rewrite if something changed, including mods being removed
+    if (walked || index.size() != mods.size()) {
+        save_mod_index(mods);
+    }
+
+    negative_filter.clear();
+    if (!config.developer_mode) {
+        build_negative_filter();
+    }
+
+    log_verbose("Indexed %d unique mod paths", mod_overlay.size());
+    log_misc("Mod scan took %d ms (%d of %d mods walked)", time() - start, walked, mods.size());
 }
 
 // data, data2, data_op2 etc
 // data is "flat", all others must have their own special subfolders
 static vector<string> game_folders;
 
+// "data/" followed by every game folder, in priority order. Scanned together in
+// one pass by normalise_path, gated by their (case-folded) first characters.
+static vector<string> path_prefixes;
+static bool prefix_first_chars[256];
+
 void init_modpath_handler(void) {
+    game_folders.clear();
     for (auto folder : folders_in_folder(".")) {
         // data is the normal case we transparently handle
         if (!strcasecmp(folder.c_str(), "data")) {
@@ -89,38 +552,81 @@ void init_modpath_handler(void) {
 
         game_folders.push_back(folder + "/");
     }
-}
 
-optional<string> normalise_path(const string &_path) {
-    auto path = _path;
-    ramfs_demangler_demangle_if_possible(path);
+    path_prefixes.clear();
+    path_prefixes.push_back("data/");
+    path_prefixes.insert(path_prefixes.end(), game_folders.begin(), game_folders.end());
 
-    auto data_pos = string_find_icase(path, "data/");
-    auto other_pos = string::npos;
+    memset(prefix_first_chars, 0, sizeof(prefix_first_chars));
+    for (auto &prefix : path_prefixes) {
+        prefix_first_chars[(uint8_t)tolower((uint8_t)prefix[0])] = true;
+        prefix_first_chars[(uint8_t)toupper((uint8_t)prefix[0])] = true;
+    }
+}
+
+optional<std::string_view> normalise_path(const char *_path, norm_path_buf &buf) {
+    auto path = ramfs_demangler_demangle_if_possible(_path, buf, sizeof(buf));
+    if (!path) {
+        log_warning("Path too long to mod: %s", _path);
+        return nullopt;
+    }
+    size_t path_len = strlen(path);
+
+    // Find where the game folder starts. "data/" anywhere beats any other game
+    // folder, and earlier game folders beat later ones.
+    size_t best_prefix = path_prefixes.size();
+    size_t best_pos = 0;
+    for (size_t i = 0; i < path_len && best_prefix != 0; i++) {
+        if (!prefix_first_chars[(uint8_t)path[i]]) {
+            continue;
+        }
 
-    if (data_pos == string::npos) {
-        // search all our other folders for anything that matches
-        for (auto folder : game_folders) {
-            other_pos = string_find_icase(path, folder);
-            if (other_pos != string::npos) {
+        for (size_t j = 0; j < best_prefix; j++) {
+            auto &prefix = path_prefixes[j];
+            if (prefix.length() <= path_len - i &&
+                    !strncasecmp(&path[i], prefix.c_str(), prefix.length())) {
+                best_prefix = j;
+                best_pos = i;
                 break;
             }
         }
+    }
+
+    if (best_prefix == path_prefixes.size()) {
+        return nullopt;
+    }
+
+    // if data2 was found, for example, use root mod/data2/.../... instead of just mod/.../...
+    if (best_prefix == 0) {
+        best_pos += strlen("data/");
+    }
 
-        if (other_pos == string::npos) {
+    // Copy out, converting backslashes and collapsing repeated slashes. The
+    // output never outruns the input, so this is safe when path is buf.
+    size_t out = 0;
+    for (size_t i = best_pos; i < path_len; i++) {
+        char c = path[i] == '\\' ? '/' : path[i];
+        if (c == '/' && out > 0 && buf[out - 1] == '/') {
+            continue;
+        }
+        if (out + 1 >= sizeof(buf)) {
+            log_warning("Path too long to mod: %s", _path);
             return nullopt;
         }
+        buf[out++] = c;
     }
-    auto actual_pos = (data_pos != string::npos) ? data_pos : other_pos;
-    // if data2 was found, for example, use root mod/data2/.../... instead of just mod/.../...
-    auto offset = (other_pos != string::npos) ? 0 : strlen("data/");
-    auto data_str = path.substr(actual_pos + offset);
-    // nuke backslash
-    string_replace(data_str, "\\", "/");
-    // nuke double slash
-    string_replace(data_str, "//", "/");
-
-    return data_str;
+    buf[out] = '\0';
+
+    return std::string_view(buf, out);
+}
+
+optional<string> normalise_path(const string &path) {
+    norm_path_buf buf;
+    auto norm = normalise_path(path.c_str(), buf);
+    if (!norm) {
+        return nullopt;
+    }
+    return string(*norm);
 }
 
 vector<string> available_mods() {
@@ -162,7 +668,7 @@ vector<string> available_mods() {
     }
     else {
         for (auto &dir : cached_mods) {
-            ret.push_back(dir.name);
+            ret.push_back(dir);
         }
     }
     // case insensitive, so apple comes before English
@@ -201,15 +707,12 @@ bool mkdir_p(const string &path) {
 
 // same for files and folders when cached
 optional<string> find_first_cached_item(const string &norm_path) {
-    for (auto &dir : cached_mods) {
-        auto file_search = dir.contents.find(norm_path);
-        if (file_search == dir.contents.end()) {
-            continue;
-        }
-        return dir.name + "/" + *file_search;
+    auto search = mod_overlay.find(norm_path);
+    if (search == mod_overlay.end()) {
+        return nullopt;
     }
 
-    return nullopt;
+    return search->second.front();
 }
 
 optional<string> find_first_modfile(const string &norm_path) {
@@ -243,6 +746,29 @@ optional<string> find_first_modfolder(const string &norm_path) {
     return nullopt;
 }
 
+vector<string> find_all_ifs_modfolders(void) {
+    vector<string> ret;
+
+    for (auto &[item, _providers] : mod_overlay) {
+        if (string_ends_with(item, "_ifs/")) {
+            ret.push_back(item.substr(0, item.length() - 1));
+        }
+    }
+
+    return ret;
+}
+
+vector<string> find_all_modpaths(void) {
+    vector<string> ret;
+    ret.reserve(mod_overlay.size());
+
+    for (auto &[item, _providers] : mod_overlay) {
+        ret.push_back(item);
+    }
+
+    return ret;
+}
+
 vector<string> find_all_modfile(const string &norm_path) {
     vector<string> ret;
 
@@ -255,12 +781,9 @@ vector<string> find_all_modfile(const string &norm_path) {
         }
     }
     else {
-        for (auto &dir : cached_mods) {
-            auto file_search = dir.contents.find(norm_path);
-            if (file_search == dir.contents.end()) {
-                continue;
-            }
-            ret.push_back(dir.name + "/" + *file_search);
+        auto search = mod_overlay.find(norm_path);
+        if (search != mod_overlay.end()) {
+            ret = search->second;
         }
     }
     // needed for consistency when hashing names
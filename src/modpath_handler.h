@@ -1,6 +1,9 @@
 #pragma once
 
+#include <stdint.h>
+
 #include <string>
+#include <string_view>
 #include <vector>
 
 #if 0
@@ -17,9 +20,30 @@ using std::vector;
 void init_modpath_handler(void);
 void cache_mods(void);
 vector<string> available_mods();
-// mutates source string to be all lowercase
+// Scratch space for normalise_path, meant to live on the caller's stack. Way
+// more than AVS allows (convert_path caps at 256).
+#define NORM_PATH_MAX 1024
+typedef char norm_path_buf[NORM_PATH_MAX];
+// Demangles and strips the game folder prefix from a path. Doesn't allocate:
+// the returned view points into buf.
+optional<std::string_view> normalise_path(const char *path, norm_path_buf &buf);
 optional<string> normalise_path(const string &path);
 optional<string> find_first_modfile(const string &norm_path);
 optional<string> find_first_modfolder(const string &norm_path);
 vector<string> find_all_modfile(const string &norm_path);
+// Every "xxx_ifs" folder provided by a mod, as norm paths without the trailing
+// "/". Empty in developer mode, since nothing is cached.
+vector<string> find_all_ifs_modfolders(void);
+// Every norm path provided by any mod, folders ending in "/". Also empty in
+// developer mode.
+vector<string> find_all_modpaths(void);
+
+// Cheap check for the hooks: no allocations, no locks. If false, no mod can
+// affect this path in any way and the real function can be called directly.
+bool may_be_modded(std::string_view norm_path);
+// Size and mtime of a file found by find_first_modfile/find_all_modfile, from
+// the listing cache_mods already did. False if they aren't known (developer
+// mode, or not a mod file), in which case ask the disk. A file deleted since
+// the scan reports an mtime of 0.
+bool mod_file_attribs_cached(const char *path, uint64_t &size, uint64_t &mtime);
 bool mkdir_p(const string &path);
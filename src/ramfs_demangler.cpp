@@ -30,7 +30,10 @@
 		At worst, maybe a meg of memory will be lost to saving filename mappings.
 */
 
+#include <windows.h>
+
 #include <algorithm>
+#include <atomic>
 #include <map>
 #include <unordered_map>
 #include <optional>
@@ -54,12 +57,78 @@ typedef struct {
 static map<string, file_cleanup_info_t, CaseInsensitiveCompare> cleanup_map;
 static unordered_map<AVS_FILE, string> open_file_map;
 static unordered_map<void*, string> ram_load_map;
+typedef struct {
+	// length of the mountpoint (the trie key), so lookups can splice the
+	// demangled path without building the key string
+	size_t mount_len;
+	string orig_path;
+} mangled_mount_t;
+
+typedef tsl::htrie_map<char, mangled_mount_t> mangling_trie_t;
+
 // using tries for fast prefix matches on our mangled names
 static tsl::htrie_map<char, string> ramfs_map;
-static tsl::htrie_map<char, string> mangling_map;
+// only touched by writers, under mangling_mtx
+static mangling_trie_t mangling_map;
 
 static CriticalSectionLock mangling_mtx;
 
+/*
+	Every hooked call demangles, from any thread, but mangling_map only
+	changes on .ifs opens and mounts. So readers never lock: they use an
+	immutable copy of mangling_map, which writers replace with a fresh copy.
+
+	An old copy can only be freed once nobody is reading it. Readers count
+	themselves in one of two counters, picked by the current epoch. After
+	swapping the copy, the writer moves the epoch on, so new readers count in
+	the other counter, then waits for the old one to empty. Anybody counted
+	there might have the old copy, anybody after can only have the new one.
+*/
+static std::atomic<mangling_trie_t*> mangling_snapshot;
+static std::atomic<uint32_t> snapshot_epoch;
+static std::atomic<uint32_t> snapshot_readers[2];
+
+// returns the epoch to give to snapshot_read_end
+static uint32_t snapshot_read_begin() {
+	while (true) {
+		auto epoch = snapshot_epoch.load();
+		snapshot_readers[epoch & 1]++;
+		// if the epoch moved on in between, the writer may already be done
+		// waiting for this counter
+		if (snapshot_epoch.load() == epoch) {
+			return epoch;
+		}
+		snapshot_readers[epoch & 1]--;
+	}
+}
+
+static void snapshot_read_end(uint32_t epoch) {
+	snapshot_readers[epoch & 1]--;
+}
+
+// how many times publish_mangling_map yields to readers before sleeping
+#define PUBLISH_MAX_YIELDS 64
+
+// call with mangling_mtx held, after changing mangling_map
+static void publish_mangling_map() {
+	auto old = mangling_snapshot.exchange(new mangling_trie_t(mangling_map));
+
+	auto epoch = snapshot_epoch.load();
+	snapshot_epoch.store(epoch + 1);
+	// readers hold a snapshot for a trie lookup and a memcpy, so this is short.
+	// Sleep(0) never yields to a lower priority reader, and a reader that got
+	// preempted could keep this spinning, so back off to a real sleep.
+	for (int spins = 0; snapshot_readers[epoch & 1].load() != 0; spins++) {
+		if (spins < PUBLISH_MAX_YIELDS) {
+			SwitchToThread();
+		} else {
+			Sleep(1);
+		}
+	}
+
+	delete old;
+}
+
 // since we call this from a function that is already taking the lock
 static void ramfs_demangler_demangle_if_possible_nolock(std::string& raw_path);
 
@@ -83,6 +152,7 @@ void ramfs_demangler_on_fs_open(const std::string& path, AVS_FILE open_result) {
 		}
 		if (cleanup.mounted_path) {
 			mangling_map.erase(*cleanup.mounted_path);
+			publish_mangling_map();
 		}
 		cleanup_map.erase(existing_info);
 	}
@@ -155,7 +225,8 @@ void ramfs_demangler_on_fs_mount(const char* mountpoint, const char* fsroot, con
 		if (find != ramfs_map.end()) {
 			auto orig_path = *find;
 			log_verbose("imagefs mount mapped to %s", orig_path.c_str());
-			mangling_map[mountpoint] = orig_path;
+			mangling_map[mountpoint] = mangled_mount_t { strlen(mountpoint), orig_path };
+			publish_mangling_map();
 
 			auto cleanup = cleanup_map.find(orig_path);
 			if (cleanup != cleanup_map.end()) {
@@ -167,7 +238,8 @@ void ramfs_demangler_on_fs_mount(const char* mountpoint, const char* fsroot, con
 			string root = (string)fsroot;
 			ramfs_demangler_demangle_if_possible_nolock(root);
 			log_verbose("imagefs mount mapped to %s", root.c_str());
-			mangling_map[mountpoint] = root;
+			mangling_map[mountpoint] = mangled_mount_t { strlen(mountpoint), root };
+			publish_mangling_map();
 		}
 	}
 
@@ -175,20 +247,51 @@ void ramfs_demangler_on_fs_mount(const char* mountpoint, const char* fsroot, con
 }
 
 void ramfs_demangler_demangle_if_possible(std::string& raw_path) {
-	mangling_mtx.lock();
+	auto epoch = snapshot_read_begin();
+	auto snapshot = mangling_snapshot.load();
+	if (snapshot) {
+		auto search = snapshot->longest_prefix(raw_path);
+		if (search != snapshot->end()) {
+			raw_path.replace(0, search->mount_len, search->orig_path);
+		}
+	}
+	snapshot_read_end(epoch);
+}
 
-	auto search = mangling_map.longest_prefix(raw_path);
-	if (search != mangling_map.end()) {
-		// log_verbose("can demangle %s to %s", search.key().c_str(), search->c_str());
-		string_replace(raw_path, search.key().c_str(), search->c_str());
+const char* ramfs_demangler_demangle_if_possible(const char* raw_path, char* buf, size_t buf_len) {
+	const char* ret = raw_path;
+
+	auto epoch = snapshot_read_begin();
+	// nothing has been mounted yet
+	auto snapshot = mangling_snapshot.load();
+	if (!snapshot) {
+		snapshot_read_end(epoch);
+		return ret;
 	}
 
-	mangling_mtx.unlock();
+	auto search = snapshot->longest_prefix(raw_path);
+	if (search != snapshot->end()) {
+		auto &mount = search.value();
+		auto rest = raw_path + mount.mount_len;
+		auto rest_len = strlen(rest);
+		if (mount.orig_path.length() + rest_len < buf_len) {
+			memcpy(buf, mount.orig_path.c_str(), mount.orig_path.length());
+			memcpy(buf + mount.orig_path.length(), rest, rest_len + 1);
+			ret = buf;
+		} else {
+			ret = NULL;
+		}
+	}
+
+	snapshot_read_end(epoch);
+
+	return ret;
 }
 
 static void ramfs_demangler_demangle_if_possible_nolock(std::string& raw_path) {
 	auto search = mangling_map.longest_prefix(raw_path);
 	if (search != mangling_map.end()) {
-		string_replace(raw_path, search.key().c_str(), search->c_str());
+		// log_verbose("can demangle %s to %s", search.key().c_str(), search->orig_path.c_str());
+		raw_path.replace(0, search->mount_len, search->orig_path);
 	}
 }
@@ -6,4 +6,7 @@
 void ramfs_demangler_on_fs_open(const std::string& norm_path, AVS_FILE open_result);
 void ramfs_demangler_on_fs_read(AVS_FILE context, void* dest);
 void ramfs_demangler_on_fs_mount(const char* mountpoint, const char* fsroot, const char* fstype, const char* flags);
-void ramfs_demangler_demangle_if_possible(std::string& norm_path);
\ No newline at end of file
+void ramfs_demangler_demangle_if_possible(std::string& norm_path);
+// Allocation-free version. Returns raw_path if there is nothing to demangle, buf
+// if the demangled path was written there, or NULL if it doesn't fit in buf.
+const char* ramfs_demangler_demangle_if_possible(const char* raw_path, char* buf, size_t buf_len);
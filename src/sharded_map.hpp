@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "utils.hpp"
+#include "winxp_mutex.hpp"
+
+// A case insensitive string -> V map for when many threads look things up at
+// once. Each key's case-folded hash is worked out once: the top bits pick one
+// of 2^SHARD_BITS separately locked shards, and the shard's hash table reuses
+// the whole thing, so threads only wait on each other when they land in the
+// same shard. Lookups copy the value out, so V should be cheap to copy (a
+// shared_ptr, usually). CriticalSections only, so it's fine on XP.
+template<typename V, unsigned SHARD_BITS = 4>
+class ShardedMap {
+    public:
+    void insert_or_assign(const std::string &key, V value) {
+        auto hash = string_hash_icase(key.c_str(), key.length());
+        auto &shard = shard_for(hash);
+
+        shard.lock.lock();
+        shard.map.insert_or_assign(hashed_key {hash, key}, std::move(value));
+        shard.lock.unlock();
+    }
+
+    std::optional<V> find(std::string_view key) {
+        auto hash = string_hash_icase(key.data(), key.length());
+        auto &shard = shard_for(hash);
+        std::optional<V> ret;
+
+        shard.lock.lock();
+        auto search = shard.map.find(hashed_view {hash, key});
+        if (search != shard.map.end()) {
+            ret = search->second;
+        }
+        shard.lock.unlock();
+
+        return ret;
+    }
+
+    // Calls fn(key, value) for every entry. Only one shard is locked at a
+    // time, so anything added meanwhile may or may not be seen.
+    template<typename F>
+    void for_each(F fn) {
+        for (auto &shard : shards) {
+            shard.lock.lock();
+            for (auto &[key, value] : shard.map) {
+                fn(key.str, value);
+            }
+            shard.lock.unlock();
+        }
+    }
+
+    size_t size() {
+        size_t ret = 0;
+        for (auto &shard : shards) {
+            shard.lock.lock();
+            ret += shard.map.size();
+            shard.lock.unlock();
+        }
+        return ret;
+    }
+
+    private:
+    struct hashed_key {
+        uint32_t hash;
+        std::string str;
+    };
+    // so lookups don't have to copy the key
+    struct hashed_view {
+        uint32_t hash;
+        std::string_view str;
+    };
+
+    struct key_hash {
+        using is_transparent = void;
+        size_t operator()(const hashed_key &key) const { return key.hash; }
+        size_t operator()(const hashed_view &key) const { return key.hash; }
+    };
+    struct key_equal {
+        using is_transparent = void;
+        template<typename A, typename B>
+        bool operator()(const A &a, const B &b) const {
+            return a.hash == b.hash && a.str.length() == b.str.length() &&
+                strncasecmp(a.str.data(), b.str.data(), a.str.length()) == 0;
+        }
+    };
+
+    struct shard_t {
+        CriticalSectionLock lock;
+        std::unordered_map<hashed_key, V, key_hash, key_equal> map;
+    };
+    shard_t shards[1 << SHARD_BITS];
+
+    shard_t& shard_for(uint32_t hash) {
+        return shards[hash >> (32 - SHARD_BITS)];
+    }
+};
@@ -0,0 +1,206 @@
+#include "stats.hpp"
+
+#include <windows.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "log.hpp"
+#include "winxp_mutex.hpp"
+
+// 4 buckets per power of 2 nanoseconds, so percentiles are within 25%
+#define STATS_SUB_BITS 2
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS (64 * STATS_SUB_BUCKETS)
+
+static const char *hook_names[STATS_HOOK_COUNT] = {
+    "avs_fs_open",
+    "avs_fs_lstat",
+    "avs_fs_convert_path",
+    "avs_fs_read",
+    "avs_fs_mount",
+    "pkfs_open",
+};
+
+// Each thread only ever writes its own, so no lock prefixes or cache line
+// fights on the hot path. Atomic only so stats_dump can read them meanwhile.
+typedef struct thread_stats_t {
+    std::atomic<uint32_t> buckets[STATS_HOOK_COUNT][2][STATS_BUCKETS];
+    std::atomic<uint64_t> max_ns[STATS_HOOK_COUNT][2];
+    thread_stats_t *next;
+} thread_stats_t;
+
+// Pushed onto without a lock, so stats_dump never waits on a hooked call.
+// Never freed, threads that have exited still count.
+static std::atomic<thread_stats_t*> all_thread_stats;
+thread_local static thread_stats_t *my_stats;
+
+static std::atomic<uint32_t> events[STATS_EVENT_COUNT];
+
+static thread_stats_t& thread_stats() {
+    if (!my_stats) {
+        my_stats = new thread_stats_t();
+        my_stats->next = all_thread_stats.load(std::memory_order_relaxed);
+        while (!all_thread_stats.compare_exchange_weak(my_stats->next, my_stats,
+                std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+    return *my_stats;
+}
+
+static uint64_t qpc_freq() {
+    static uint64_t freq = [] {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        return (uint64_t)f.QuadPart;
+    }();
+    return freq;
+}
+
+static uint32_t bucket_for(uint64_t ns) {
+    if (ns < STATS_SUB_BUCKETS) {
+        return (uint32_t)ns;
+    }
+    uint32_t msb = 63 - __builtin_clzll(ns);
+    uint32_t sub = (ns >> (msb - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+    return (msb - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+// the largest value that lands in a bucket
+static uint64_t bucket_max(uint32_t bucket) {
+    if (bucket < STATS_SUB_BUCKETS) {
+        return bucket;
+    }
+    uint32_t shift = bucket / STATS_SUB_BUCKETS - 1;
+    uint64_t sub = bucket % STATS_SUB_BUCKETS;
+    return ((STATS_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+uint64_t stats_now(void) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void stats_record(stats_hook hook, bool modded, uint64_t start) {
+    auto ticks = stats_now() - start;
+    auto freq = qpc_freq();
+    auto ns = (ticks / freq) * 1000000000 + (ticks % freq) * 1000000000 / freq;
+
+    auto &stats = thread_stats();
+    auto &bucket = stats.buckets[hook][modded][bucket_for(ns)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    auto &max = stats.max_ns[hook][modded];
+    if (ns > max.load(std::memory_order_relaxed)) {
+        max.store(ns, std::memory_order_relaxed);
+    }
+}
+
+void stats_count(stats_event event) {
+    if (config.stats) {
+        events[event]++;
+    }
+}
+
+static const char* format_ns(uint64_t ns, char (&buf)[16]) {
+    if (ns < 1000) {
+        snprintf(buf, sizeof(buf), "%uns", (uint32_t)ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, sizeof(buf), "%.1fus", ns / 1000.0);
+    } else if (ns < 1000000000) {
+        snprintf(buf, sizeof(buf), "%.1fms", ns / 1000000.0);
+    } else {
+        snprintf(buf, sizeof(buf), "%.2fs", ns / 1000000000.0);
+    }
+    return buf;
+}
+
+void stats_dump(void) {
+    if (!config.stats) {
+        return;
+    }
+
+    static uint64_t buckets[STATS_HOOK_COUNT][2][STATS_BUCKETS];
+    static uint64_t max_ns[STATS_HOOK_COUNT][2];
+    static CriticalSectionLock dump_mtx;
+
+    dump_mtx.lock();
+    memset(buckets, 0, sizeof(buckets));
+    memset(max_ns, 0, sizeof(max_ns));
+
+    int threads = 0;
+    for (auto stats = all_thread_stats.load(std::memory_order_acquire); stats; stats = stats->next) {
+        threads++;
+        for (int hook = 0; hook < STATS_HOOK_COUNT; hook++) {
+            for (int modded = 0; modded < 2; modded++) {
+                for (int i = 0; i < STATS_BUCKETS; i++) {
+                    buckets[hook][modded][i] += stats->buckets[hook][modded][i].load(std::memory_order_relaxed);
+                }
+                auto max = stats->max_ns[hook][modded].load(std::memory_order_relaxed);
+                if (max > max_ns[hook][modded]) {
+                    max_ns[hook][modded] = max;
+                }
+            }
+        }
+    }
+    log_info("Hook stats (%d threads):", threads);
+
+    for (int hook = 0; hook < STATS_HOOK_COUNT; hook++) {
+        for (int modded = 0; modded < 2; modded++) {
+            auto &hist = buckets[hook][modded];
+            uint64_t calls = 0;
+            for (int i = 0; i < STATS_BUCKETS; i++) {
+                calls += hist[i];
+            }
+            if (calls == 0) {
+                continue;
+            }
+
+            // the first bucket that takes us past the percentile
+            auto percentile = [&](uint64_t pct) {
+                uint64_t target = (calls * pct + 99) / 100;
+                uint64_t seen = 0;
+                for (uint32_t i = 0; i < STATS_BUCKETS; i++) {
+                    seen += hist[i];
+                    if (seen >= target) {
+                        return std::min(bucket_max(i), max_ns[hook][modded]);
+                    }
+                }
+                return max_ns[hook][modded];
+            };
+
+            char p50[16], p99[16], max[16];
+            log_info("  %-20s %-11s %8llu calls  p50 %8s  p99 %8s  max %8s",
+                hook_names[hook], modded ? "modded" : "passthrough", (unsigned long long)calls,
+                format_ns(percentile(50), p50), format_ns(percentile(99), p99),
+                format_ns(max_ns[hook][modded], max));
+        }
+    }
+
+    log_info("  generated: %u textures, %u texbins, %u merged XMLs",
+        events[STATS_TEXTURE_BUILT].load(), events[STATS_TEXBIN_BUILT].load(), events[STATS_XML_MERGED].load());
+    dump_mtx.unlock();
+}
+
+static DWORD WINAPI stats_thread(LPVOID) {
+    while (true) {
+        Sleep(config.stats_interval * 1000);
+        stats_dump();
+    }
+    return 0;
+}
+
+void stats_init(void) {
+    if (!config.stats || !config.stats_interval) {
+        return;
+    }
+
+    // fine from DllMain, it just won't start running until we're loaded
+    auto thread = CreateThread(NULL, 0, stats_thread, NULL, 0, NULL);
+    if (thread) {
+        CloseHandle(thread);
+    } else {
+        log_warning("Couldn't start stats thread: %d", GetLastError());
+    }
+}
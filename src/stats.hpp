@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "config.hpp"
+
+// Latency of each hook, to see how much we add to the game's loading. Only
+// collected with --layered-stats: otherwise every hook pays a single branch.
+
+enum stats_hook {
+    STATS_AVS_FS_OPEN,
+    STATS_AVS_FS_LSTAT,
+    STATS_AVS_FS_CONVERT_PATH,
+    STATS_AVS_FS_READ,
+    STATS_AVS_FS_MOUNT,
+    STATS_PKFS_OPEN,
+    STATS_HOOK_COUNT,
+};
+
+// work a hook call had to do before the game got its file
+enum stats_event {
+    STATS_TEXTURE_BUILT,
+    STATS_TEXBIN_BUILT,
+    STATS_XML_MERGED,
+    STATS_EVENT_COUNT,
+};
+
+uint64_t stats_now(void);
+void stats_record(stats_hook hook, bool modded, uint64_t start);
+void stats_count(stats_event event);
+
+// Start the --layered-stats-interval dump thread, if asked for
+void stats_init(void);
+// Log p50/p99/max of every hook, split by whether a mod was used
+void stats_dump(void);
+
+// Times a hook call from construction to destruction. Set `modded` if a mod
+// was used, to keep the passthrough numbers separate.
+class StatsTimer {
+    public:
+    bool modded;
+
+    explicit StatsTimer(stats_hook hook)
+        : modded(false)
+        , hook(hook)
+        , start(config.stats ? stats_now() : 0)
+    {}
+    ~StatsTimer() {
+        if (start) {
+            stats_record(hook, modded, start);
+        }
+    }
+
+    private:
+    stats_hook hook;
+    uint64_t start;
+};
@@ -0,0 +1,140 @@
+#include "swizzle.hpp"
+
+#include <immintrin.h>
+
+// The DLL is built for plain i686/x86_64, so the SIMD versions are compiled
+// per-function with target attributes and picked at runtime. 32 bit Windows
+// only guarantees a 4 byte aligned stack, hence force_align_arg_pointer.
+#define SIMD_FUNC(isa) __attribute__((target(isa), force_align_arg_pointer))
+
+static void swap_rb_scalar(uint8_t *pixels, size_t len) {
+    for (size_t i = 0; i + 4 <= len; i += 4) {
+        auto tmp = pixels[i];
+        pixels[i] = pixels[i + 2];
+        pixels[i + 2] = tmp;
+    }
+}
+
+static void swap_words_scalar(uint8_t *data, size_t len) {
+    for (size_t i = 0; i + 2 <= len; i += 2) {
+        auto tmp = data[i];
+        data[i] = data[i + 1];
+        data[i + 1] = tmp;
+    }
+}
+
+// SSE2 has no byte shuffle, so do it with masks and shifts on each pixel:
+// keep G and A, move R up 16 bits and B down 16 bits
+SIMD_FUNC("sse2")
+static void swap_rb_sse2(uint8_t *pixels, size_t len) {
+    const __m128i ga = _mm_set1_epi32((int)0xFF00FF00);
+    const __m128i low = _mm_set1_epi32(0x000000FF);
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        auto p = (__m128i*)&pixels[i];
+        __m128i v = _mm_loadu_si128(p);
+        __m128i r = _mm_slli_epi32(_mm_and_si128(v, low), 16);
+        __m128i b = _mm_and_si128(_mm_srli_epi32(v, 16), low);
+        v = _mm_or_si128(_mm_and_si128(v, ga), _mm_or_si128(r, b));
+        _mm_storeu_si128(p, v);
+    }
+
+    swap_rb_scalar(&pixels[i], len - i);
+}
+
+SIMD_FUNC("sse2")
+static void swap_words_sse2(uint8_t *data, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        auto p = (__m128i*)&data[i];
+        __m128i v = _mm_loadu_si128(p);
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128(p, v);
+    }
+
+    swap_words_scalar(&data[i], len - i);
+}
+
+SIMD_FUNC("avx2")
+static void swap_rb_avx2(uint8_t *pixels, size_t len) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15
+    );
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        auto p = (__m256i*)&pixels[i];
+        _mm256_storeu_si256(p, _mm256_shuffle_epi8(_mm256_loadu_si256(p), shuffle));
+    }
+
+    swap_rb_scalar(&pixels[i], len - i);
+}
+
+SIMD_FUNC("avx2")
+static void swap_words_avx2(uint8_t *data, size_t len) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+    );
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        auto p = (__m256i*)&data[i];
+        _mm256_storeu_si256(p, _mm256_shuffle_epi8(_mm256_loadu_si256(p), shuffle));
+    }
+
+    swap_words_scalar(&data[i], len - i);
+}
+
+swizzle_isa swizzle_best_isa(void) {
+    static swizzle_isa best = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return SWIZZLE_AVX2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return SWIZZLE_SSE2;
+        }
+        return SWIZZLE_SCALAR;
+    }();
+
+    return best;
+}
+
+void swizzle_swap_rb(uint8_t *pixels, size_t len, swizzle_isa isa) {
+    switch (isa) {
+    case SWIZZLE_AVX2:
+        swap_rb_avx2(pixels, len);
+        break;
+    case SWIZZLE_SSE2:
+        swap_rb_sse2(pixels, len);
+        break;
+    default:
+        swap_rb_scalar(pixels, len);
+        break;
+    }
+}
+
+void swizzle_swap_words(uint8_t *data, size_t len, swizzle_isa isa) {
+    switch (isa) {
+    case SWIZZLE_AVX2:
+        swap_words_avx2(data, len);
+        break;
+    case SWIZZLE_SSE2:
+        swap_words_sse2(data, len);
+        break;
+    default:
+        swap_words_scalar(data, len);
+        break;
+    }
+}
+
+void swizzle_swap_rb(uint8_t *pixels, size_t len) {
+    swizzle_swap_rb(pixels, len, swizzle_best_isa());
+}
+
+void swizzle_swap_words(uint8_t *data, size_t len) {
+    swizzle_swap_words(data, len, swizzle_best_isa());
+}
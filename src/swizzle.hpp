@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// In-place channel swizzles for texture data, using the widest vector unit the
+// CPU has. Trailing bytes that don't make up a whole pixel/word are left alone.
+
+enum swizzle_isa {
+    SWIZZLE_SCALAR,
+    SWIZZLE_SSE2,
+    SWIZZLE_AVX2,
+};
+
+// the best the running CPU supports
+swizzle_isa swizzle_best_isa(void);
+
+// RGBA <-> BGRA, for 32bpp pixels
+void swizzle_swap_rb(uint8_t *pixels, size_t len);
+// swap the bytes of every 16 bit word, which the DXT data in IFS files needs
+void swizzle_swap_words(uint8_t *data, size_t len);
+
+// as above, but forcing a particular implementation. Only for tests, the
+// isa must be supported
+void swizzle_swap_rb(uint8_t *pixels, size_t len, swizzle_isa isa);
+void swizzle_swap_words(uint8_t *data, size_t len, swizzle_isa isa);
@@ -1,13 +1,32 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
+#include <fstream>
+#include <sstream>
+
+#include "avs.h"
 #include "config.hpp"
+#include "content_hash.hpp"
+#include "dxt.hpp"
 #include "hook.h"
 #include "imagefs.hpp"
 #include "avs_standalone.hpp"
+#include "lz77.hpp"
 #include "modpath_handler.h"
+#include "ramfs_demangler.h"
+#include "sharded_map.hpp"
+#include "swizzle.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include "texbin.hpp"
+#include "3rd_party/lodepng.h"
+#include "3rd_party/stb_dxt.h"
+#include "3rd_party/libsquish/squish.h"
+#include "3rd_party/MurmurHash3.h"
 
 using ::testing::Contains;
+using ::testing::EndsWith;
+using ::testing::HasSubstr;
 using ::testing::Optional;
 
 #define FOREACH_EXTRA_FUNC(X)                                                                                                                              \
@@ -149,3 +168,833 @@ TEST(ImageFs, MD5DemanglingWorks) {
 
    avs_fs_umount_by_desc(desc);
 }
+
+// the game folders normalise_path_reference looks for, found the same way
+// init_modpath_handler does
+static std::vector<std::string> reference_game_folders() {
+   std::vector<std::string> game_folders;
+   for (auto folder : folders_in_folder(".")) {
+      if (!strcasecmp(folder.c_str(), "data")) {
+         continue;
+      }
+      game_folders.push_back(folder + "/");
+   }
+   return game_folders;
+}
+
+// the pre-buffer implementation, kept around to check the fast path against
+static std::optional<std::string> normalise_path_reference(const std::string &_path, const std::vector<std::string> &game_folders) {
+   auto path = _path;
+   ramfs_demangler_demangle_if_possible(path);
+
+   auto data_pos = string_find_icase(path, "data/");
+   auto other_pos = std::string::npos;
+
+   if (data_pos == std::string::npos) {
+      // search all our other folders for anything that matches
+      for (auto folder : game_folders) {
+         other_pos = string_find_icase(path, folder);
+         if (other_pos != std::string::npos) {
+            break;
+         }
+      }
+
+      if (other_pos == std::string::npos) {
+         return std::nullopt;
+      }
+   }
+   auto actual_pos = (data_pos != std::string::npos) ? data_pos : other_pos;
+   // if data2 was found, for example, use root mod/data2/.../... instead of just mod/.../...
+   auto offset = (other_pos != std::string::npos) ? 0 : strlen("data/");
+   auto data_str = path.substr(actual_pos + offset);
+   string_replace(data_str, "\\", "/");
+   string_replace(data_str, "//", "/");
+
+   return data_str;
+}
+
+// Runs from a scratch game folder under the cache holding only `folders`, so
+// nothing lands in the source tree. Everything is put back however the test
+// ends, failed ASSERTs included.
+class ScratchGameRoot {
+   public:
+   explicit ScratchGameRoot(std::initializer_list<const char*> folders)
+      : root(CACHE_FOLDER + "/game_root")
+   {
+      GetCurrentDirectoryA(sizeof(old_cwd), old_cwd);
+      for (auto folder : folders) {
+         this->folders.push_back(root + "/" + folder);
+         mkdir_p(this->folders.back());
+      }
+      ok = SetCurrentDirectoryA(root.c_str());
+      init_modpath_handler();
+   }
+   ~ScratchGameRoot() {
+      SetCurrentDirectoryA(old_cwd);
+      for (auto &folder : folders) {
+         RemoveDirectoryA(folder.c_str());
+      }
+      RemoveDirectoryA(root.c_str());
+      init_modpath_handler();
+   }
+
+   bool ok;
+
+   private:
+   std::string root;
+   std::vector<std::string> folders;
+   char old_cwd[MAX_PATH];
+};
+
+TEST(ModpathHandler, NormalisePathMatchesReference) {
+   // extra game folders, like the ones some games ship next to data
+   ScratchGameRoot game_root({"data", "data2", "DATA_op2"});
+   ASSERT_TRUE(game_root.ok);
+   auto game_folders = reference_game_folders();
+   ASSERT_THAT(game_folders, Contains("data2/"));
+   ASSERT_THAT(game_folders, Contains("DATA_op2/"));
+
+   const char *paths[] = {
+      "/data/graphics/ver04/logo.ifs",
+      "D:\\game\\contents\\data\\sound\\bgm.ifs",
+      "/afp/DATA/tex/texturelist.xml",
+      "/data//graphics\\\\gmframe/frame.png",
+      "/dev/nvram/game.cfg",
+      "/data2/graphic/information.ifs",
+      "D:\\game\\contents\\Data2\\sound\\se.ifs",
+      "/data_OP2/tex/texturelist.xml",
+      "/DATA_op2//movie\\\\intro.wmv",
+      // data/ beats any other game folder, wherever it is
+      "/data2/nested/data/file.xml",
+      // and game folders are picked in order, not by position
+      "/data2/nested/data_op2/file.xml",
+      "/data_op2/nested/data2/file.xml",
+      "/data2",
+   };
+
+   for (auto path : paths) {
+      norm_path_buf buf;
+      auto fast = normalise_path(path, buf);
+      auto reference = normalise_path_reference(path, game_folders);
+      EXPECT_EQ(fast.has_value(), reference.has_value()) << path;
+      if (fast && reference) {
+         EXPECT_EQ(std::string(*fast), *reference) << path;
+      }
+   }
+}
+
+TEST(ModpathHandler, CachedAttribsMatchDisk) {
+   auto path = find_first_modfile("test_ifs/outer.png");
+   ASSERT_TRUE(path);
+
+   uint64_t size, mtime;
+   ASSERT_TRUE(mod_file_attribs_cached(path->c_str(), size, mtime));
+   WIN32_FILE_ATTRIBUTE_DATA disk;
+   ASSERT_TRUE(GetFileAttributesExA(path->c_str(), GetFileExInfoStandard, &disk));
+   EXPECT_EQ(size, ((uint64_t)disk.nFileSizeHigh << 32) | disk.nFileSizeLow);
+   EXPECT_EQ(mtime, ((uint64_t)disk.ftLastWriteTime.dwHighDateTime << 32) | disk.ftLastWriteTime.dwLowDateTime);
+   EXPECT_EQ(file_time(path->c_str()), mtime);
+   EXPECT_TRUE(file_exists(path->c_str()));
+
+   // not a mod file, so it has to go to the disk
+   EXPECT_FALSE(mod_file_attribs_cached("./testcases_data_mods", size, mtime));
+   config.developer_mode = true;
+   EXPECT_FALSE(mod_file_attribs_cached(path->c_str(), size, mtime));
+   config.developer_mode = false;
+}
+
+TEST(RamfsDemangler, MountsDuringLookups) {
+   const int mounts = 200;
+   auto mountpoint = [](int i) {
+      char path[64];
+      snprintf(path, sizeof(path), "/demangle_test/%03d", i);
+      return std::string(path);
+   };
+   auto ifs_path = [](int i) {
+      return "/data/graphics/demangle_test_" + std::to_string(i) + ".ifs";
+   };
+
+   std::atomic<bool> mounting = true;
+   std::atomic<size_t> wrong = 0;
+   background_pool().parallel_for(4, [&](size_t t) {
+      if (t == 0) {
+         for (int i = 0; i < mounts; i++) {
+            ramfs_demangler_on_fs_mount(mountpoint(i).c_str(), ifs_path(i).c_str(), "imagefs", NULL);
+         }
+         mounting = false;
+         return;
+      }
+
+      for (int i = 0; mounting || i < mounts; i++) {
+         auto n = i % mounts;
+         auto path = mountpoint(n) + "/tex/texturelist.xml";
+         norm_path_buf buf;
+         auto demangled = ramfs_demangler_demangle_if_possible(path.c_str(), buf, sizeof(buf));
+         // either not mounted yet, or fully mapped
+         if (demangled != path.c_str() && ifs_path(n) + "/tex/texturelist.xml" != demangled) {
+            wrong++;
+         }
+      }
+   });
+   EXPECT_EQ(wrong, 0u);
+
+   for (int i = 0; i < mounts; i++) {
+      auto path = mountpoint(i) + "/afp/afplist.xml";
+      ramfs_demangler_demangle_if_possible(path);
+      EXPECT_EQ(path, ifs_path(i) + "/afp/afplist.xml");
+   }
+}
+
+TEST(CacheHasher, ContentHashSurvivesCopies) {
+   ASSERT_TRUE(mkdir_p(CACHE_FOLDER));
+   auto write = [](const std::string &path, const char *contents) {
+      std::ofstream f(path, std::ios::binary);
+      f << contents;
+   };
+
+   auto input = CACHE_FOLDER + "/content_hash_input.txt";
+   auto copy = CACHE_FOLDER + "/content_hash_copy.txt";
+   write(input, "some mod file");
+   write(copy, "some mod file");
+   auto input_hash = file_content_hash(input.c_str());
+   auto copy_hash = file_content_hash(copy.c_str());
+   ASSERT_TRUE(input_hash && copy_hash);
+   EXPECT_EQ(memcmp(input_hash->h, copy_hash->h, sizeof(input_hash->h)), 0);
+
+   config.content_hash = true;
+   auto hash_file = CACHE_FOLDER + "/content_hash_input.hashed";
+   auto hasher_matches = [&] {
+      CacheHasher hasher(hash_file);
+      hasher.add(input);
+      hasher.finish();
+      return hasher.matches();
+   };
+   {
+      CacheHasher hasher(hash_file);
+      hasher.add(input);
+      hasher.finish();
+      hasher.commit();
+   }
+
+   // same contents with a new mtime, like a copy from another machine
+   Sleep(20);
+   write(input, "some mod file");
+   EXPECT_TRUE(hasher_matches());
+
+   write(input, "some mod file, edited");
+   EXPECT_FALSE(hasher_matches());
+   config.content_hash = false;
+}
+
+TEST(CacheHasher, SettingsChangeTheHash) {
+   ASSERT_TRUE(mkdir_p(CACHE_FOLDER));
+   auto input = CACHE_FOLDER + "/cache_hasher_settings.txt";
+   std::ofstream(input, std::ios::binary) << "some mod file";
+   auto hash_file = CACHE_FOLDER + "/cache_hasher_settings.hashed";
+
+   auto hasher_for = [&](dxt_quality_t quality) {
+      CacheHasher hasher(hash_file);
+      hasher.add(input);
+      hasher.add_bytes(&quality, sizeof(quality));
+      hasher.finish();
+      return hasher;
+   };
+   hasher_for(DXT_QUALITY_FAST).commit();
+   EXPECT_TRUE(hasher_for(DXT_QUALITY_FAST).matches());
+   EXPECT_FALSE(hasher_for(DXT_QUALITY_BEST).matches());
+}
+
+// SMHasher's VerificationTest: hash every prefix of 0, 1, 2... 255 with seed
+// 256 - length, then hash all of those hashes
+TEST(ContentHash, MurmurHash3Verification) {
+   uint8_t key[256];
+   uint8_t hashes[256 * 16];
+   for (int i = 0; i < 256; i++) {
+      key[i] = (uint8_t)i;
+      MurmurHash3_x64_128(key, i, 256 - i, &hashes[i * 16]);
+   }
+
+   uint8_t final[16];
+   MurmurHash3_x64_128(hashes, sizeof(hashes), 0, final);
+   uint32_t verification = final[0] | (final[1] << 8) | (final[2] << 16) | ((uint32_t)final[3] << 24);
+   EXPECT_EQ(verification, 0x6384BA69u);
+}
+
+TEST(ContentHash, TableSurvivesReload) {
+   ASSERT_TRUE(mkdir_p(CACHE_FOLDER));
+   auto write = [](const std::string &path, const std::string &contents) {
+      std::ofstream f(path, std::ios::binary);
+      f << contents;
+   };
+   auto table = CACHE_FOLDER + "/content_hashes.bin";
+   auto table_size = [&] {
+      std::ifstream f(table, std::ios::binary | std::ios::ate);
+      return (size_t)f.tellg();
+   };
+   auto same = [](std::optional<content_hash_t> a, std::optional<content_hash_t> b) {
+      return a && b && memcmp(a->h, b->h, sizeof(a->h)) == 0;
+   };
+
+   // start from nothing, so the counts below are ours
+   DeleteFileA(table.c_str());
+   EXPECT_EQ(content_hash_reload(), 0u);
+
+   auto first = CACHE_FOLDER + "/content_hash_first.txt";
+   auto second = CACHE_FOLDER + "/content_hash_second.txt";
+   write(first, "first");
+   write(second, "second");
+   auto first_hash = file_content_hash(first.c_str());
+   auto second_hash = file_content_hash(second.c_str());
+
+   // a fresh table, like the next boot
+   auto loaded = content_hash_reload();
+   EXPECT_EQ(loaded, 2u);
+   EXPECT_TRUE(same(file_content_hash(first.c_str()), first_hash));
+   EXPECT_TRUE(same(file_content_hash(second.c_str()), second_hash));
+
+   // a record torn part way through is dropped, and cut off so records
+   // appended after it aren't lost behind it
+   {
+      std::ofstream f(table, std::ios::binary | std::ios::app);
+      uint32_t path_len = 100;
+      f.write((const char*)&path_len, sizeof(path_len));
+      f << "C:/torn";
+   }
+   EXPECT_EQ(content_hash_reload(), loaded);
+   auto third = CACHE_FOLDER + "/content_hash_third.txt";
+   write(third, "third");
+   ASSERT_TRUE(file_content_hash(third.c_str()));
+   EXPECT_EQ(content_hash_reload(), loaded + 1);
+
+   // superseded records are compacted away
+   for (int i = 0; i < 200; i++) {
+      write(first, std::string(i + 1, 'x'));
+      ASSERT_TRUE(file_content_hash(first.c_str()));
+   }
+   auto uncompacted = table_size();
+   EXPECT_EQ(content_hash_reload(), loaded + 1);
+   EXPECT_LT(table_size(), uncompacted);
+   write(second, std::string(200, 'x'));
+   EXPECT_TRUE(same(file_content_hash(first.c_str()), file_content_hash(second.c_str())));
+}
+
+TEST(ThreadPool, NestedParallelFor) {
+   std::atomic<int> total = 0;
+   background_pool().parallel_for(16, [&](size_t i) {
+      background_pool().parallel_for(16, [&](size_t j) {
+         total++;
+      });
+   });
+   EXPECT_EQ(total, 16 * 16);
+
+   auto task = background_pool().submit([&] { total = 0; });
+   task->wait();
+   EXPECT_TRUE(task->done());
+   EXPECT_EQ(total, 0);
+}
+
+TEST(ShardedMap, ConcurrentInsertAndFind) {
+   const size_t threads = 8;
+   const size_t per_thread = 5000;
+   ShardedMap<std::shared_ptr<size_t>> map;
+   std::atomic<size_t> wrong = 0;
+   std::atomic<size_t> seen_early = 0;
+
+   auto key = [](size_t thread, size_t i) {
+      return "data/graphics/ver04/logo.ifs/tex/" + std::to_string(thread) + "_" + std::to_string(i);
+   };
+
+   background_pool().parallel_for(threads, [&](size_t t) {
+      for (size_t i = 0; i < per_thread; i++) {
+         map.insert_or_assign(key(t, i), std::make_shared<size_t>(t * per_thread + i));
+
+         // our own keys, in a different case
+         auto upper = key(t, i / 2);
+         str_toupper_inline(upper);
+         auto found = map.find(upper);
+         if (!found || **found != t * per_thread + i / 2) {
+            wrong++;
+         }
+
+         // someone else's, which may or may not be there yet
+         auto other = map.find(key((t + 1) % threads, i));
+         if (other) {
+            seen_early++;
+            if (**other != ((t + 1) % threads) * per_thread + i) {
+               wrong++;
+            }
+         }
+      }
+   });
+
+   EXPECT_EQ(wrong, 0u);
+   EXPECT_EQ(map.size(), threads * per_thread);
+   log_info("sharded map: %d of %d cross-thread lookups saw the insert", seen_early.load(), threads * per_thread);
+
+   size_t visited = 0;
+   map.for_each([&](const std::string &k, const std::shared_ptr<size_t> &v) {
+      EXPECT_EQ(*map.find(k), v);
+      visited++;
+   });
+   EXPECT_EQ(visited, threads * per_thread);
+   EXPECT_FALSE(map.find("data/graphics/ver04/logo.ifs/tex/missing"));
+}
+
+TEST(Trace, SpansFromEveryThread) {
+   ASSERT_TRUE(mkdir_p(CACHE_FOLDER));
+   auto trace_file = CACHE_FOLDER + "/trace.json";
+   config.trace_file = trace_file.c_str();
+
+   // enough for one thread to need a few chunks
+   const size_t spans = 5000;
+   background_pool().parallel_for(spans, [&](size_t i) {
+      TraceSpan span("test span", "data_mods\\some \"quoted\" path");
+   });
+   auto start = time();
+   {
+      TraceSpan span("test span");
+      Sleep(20);
+   }
+   EXPECT_GE(time() - start, 15);
+
+   trace_dump();
+   config.trace_file = NULL;
+
+   std::ifstream f(trace_file, std::ios::binary);
+   std::stringstream buf;
+   buf << f.rdbuf();
+   auto trace = buf.str();
+
+   size_t events = 0;
+   for (size_t pos = 0; (pos = trace.find("\"name\":\"test span\"", pos)) != std::string::npos; pos++) {
+      events++;
+   }
+   EXPECT_EQ(events, spans + 1);
+   EXPECT_THAT(trace, HasSubstr("\"detail\":\"data_mods\\\\some \\\"quoted\\\" path\""));
+   EXPECT_THAT(trace, EndsWith("]}\n"));
+}
+
+TEST(Texbin, ParallelReplaceMatchesSerial) {
+   ASSERT_TRUE(mkdir_p(CACHE_FOLDER));
+
+   std::vector<std::pair<std::string, std::string>> pngs;
+   for (unsigned n = 0; n < 12; n++) {
+      unsigned w = 16 + n * 4, h = 32;
+      std::vector<uint8_t> img(w * h * 4);
+      for (size_t i = 0; i < img.size(); i++) {
+         img[i] = (uint8_t)((i * 31 + n) ^ (i >> 5));
+      }
+
+      auto path = CACHE_FOLDER + "/texbin_test" + std::to_string(n) + ".png";
+      ASSERT_EQ(lodepng::encode(path, img, w, h), 0u);
+      pngs.emplace_back("IMG" + std::to_string(n % 10), path);
+   }
+
+   auto slurp = [](const std::string &path) {
+      std::ifstream f(path, std::ios::binary);
+      std::stringstream ss;
+      ss << f.rdbuf();
+      return ss.str();
+   };
+
+   Texbin serial, parallel;
+   for (auto &[name, path] : pngs) {
+      serial.add_or_replace_image(name.c_str(), path.c_str());
+   }
+   EXPECT_EQ(parallel.add_or_replace_images(pngs), pngs.size());
+
+   auto serial_out = CACHE_FOLDER + "/texbin_serial.bin";
+   auto parallel_out = CACHE_FOLDER + "/texbin_parallel.bin";
+   ASSERT_TRUE(serial.save(serial_out.c_str()));
+   ASSERT_TRUE(parallel.save(parallel_out.c_str()));
+   EXPECT_EQ(slurp(serial_out), slurp(parallel_out));
+}
+
+TEST(Texbin, FromBufferBorrowsImages) {
+   ASSERT_TRUE(mkdir_p(CACHE_FOLDER));
+
+   Texbin texbin;
+   for (unsigned n = 0; n < 4; n++) {
+      unsigned w = 8 + n * 4, h = 8;
+      std::vector<uint8_t> img(w * h * 4, (uint8_t)(n * 50));
+      auto path = CACHE_FOLDER + "/texbin_buffer" + std::to_string(n) + ".png";
+      ASSERT_EQ(lodepng::encode(path, img, w, h), 0u);
+      texbin.add_or_replace_image(("IMG" + std::to_string(n)).c_str(), path.c_str());
+   }
+   auto orig_path = CACHE_FOLDER + "/texbin_buffer.bin";
+   ASSERT_TRUE(texbin.save(orig_path.c_str()));
+
+   std::ifstream f(orig_path, std::ios::binary);
+   std::vector<uint8_t> orig((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+
+   auto parsed = Texbin::from_buffer(orig.data(), orig.size());
+   ASSERT_TRUE(parsed);
+   auto tex = parsed->images["IMG2"].tex_data();
+   EXPECT_TRUE(tex >= orig.data() && tex < orig.data() + orig.size());
+
+   // untouched images save byte for byte, wherever they were parsed from
+   auto resaved_path = CACHE_FOLDER + "/texbin_buffer_resaved.bin";
+   ASSERT_TRUE(parsed->save(resaved_path.c_str()));
+   auto mapped = Texbin::from_path(resaved_path.c_str());
+   ASSERT_TRUE(mapped);
+   EXPECT_EQ(mapped->images.size(), texbin.images.size());
+   std::ifstream resaved(resaved_path, std::ios::binary);
+   EXPECT_EQ(std::vector<uint8_t>((std::istreambuf_iterator<char>(resaved)), std::istreambuf_iterator<char>()), orig);
+
+   // a truncated file is rejected rather than read past the end
+   EXPECT_FALSE(Texbin::from_buffer(orig.data(), orig.size() - 4));
+}
+
+TEST(Texbin, SaveKeepsUntouchedImages) {
+   ASSERT_TRUE(mkdir_p(CACHE_FOLDER));
+
+   Texbin texbin;
+   std::vector<std::string> pngs;
+   for (unsigned n = 0; n < 6; n++) {
+      // odd sizes, so images need padding between them
+      unsigned w = 5 + n, h = 3;
+      std::vector<uint8_t> img(w * h * 4);
+      for (size_t i = 0; i < img.size(); i++) {
+         img[i] = (uint8_t)(i * 7 + n);
+      }
+      pngs.push_back(CACHE_FOLDER + "/texbin_untouched" + std::to_string(n) + ".png");
+      ASSERT_EQ(lodepng::encode(pngs.back(), img, w, h), 0u);
+      texbin.add_or_replace_image(("IMG" + std::to_string(n)).c_str(), pngs.back().c_str());
+   }
+   auto orig_path = CACHE_FOLDER + "/texbin_untouched.bin";
+   ASSERT_TRUE(texbin.save(orig_path.c_str()));
+
+   auto loaded = Texbin::from_path(orig_path.c_str());
+   ASSERT_TRUE(loaded);
+   ASSERT_TRUE(loaded->add_or_replace_image("IMG3", pngs[0].c_str()));
+   auto out_path = CACHE_FOLDER + "/texbin_untouched_out.bin";
+   ASSERT_TRUE(loaded->save(out_path.c_str()));
+
+   auto saved = Texbin::from_path(out_path.c_str());
+   ASSERT_TRUE(saved);
+   ASSERT_EQ(saved->images.size(), texbin.images.size());
+   for (auto &[name, image] : saved->images) {
+      auto &expected = name == "IMG3" ? loaded->images["IMG3"] : texbin.images[name];
+      EXPECT_EQ(std::vector<uint8_t>(image.tex_data(), image.tex_data() + image.tex_size()),
+         std::vector<uint8_t>(expected.tex_data(), expected.tex_data() + expected.tex_size())) << name;
+   }
+}
+
+// flat, gradient and noisy bands, like a typical game texture
+static std::vector<uint8_t> synthetic_bgra(size_t w, size_t h) {
+   std::vector<uint8_t> img(w * h * 4);
+   uint32_t rng = 1;
+   for (size_t y = 0; y < h; y++) {
+      for (size_t x = 0; x < w; x++) {
+         auto px = &img[(y * w + x) * 4];
+         rng = rng * 1103515245 + 12345;
+         if (y < h / 3) {
+            px[0] = px[1] = px[2] = px[3] = 0;
+         } else if (y < 2 * h / 3) {
+            px[0] = (uint8_t)x;
+            px[1] = (uint8_t)y;
+            px[2] = (uint8_t)((x + y) / 2);
+            px[3] = 0xff;
+         } else {
+            px[0] = (rng >> 24) & 0xf8;
+            px[1] = (rng >> 16) & 0xf8;
+            px[2] = x & 0xf0;
+            px[3] = 0xff;
+         }
+      }
+   }
+   return img;
+}
+
+TEST(Lz77, TexbinRoundTrip) {
+   std::vector<std::vector<uint8_t>> inputs = {
+      {},
+      {1},
+      {0, 0, 0},
+      std::vector<uint8_t>(5000, 0),
+      std::vector<uint8_t>(5000, 7),
+      synthetic_bgra(64, 64),
+   };
+
+   for (auto &input : inputs) {
+      for (auto level : {LZ77_LEVEL_FAST, LZ77_LEVEL_DEFAULT, LZ77_LEVEL_MAX}) {
+         auto comp = texbin_lz77_compress(input, level);
+         EXPECT_EQ(texbin_lz77_decompress(comp, 0, false), input) << input.size() << " bytes, level " << level;
+      }
+   }
+}
+
+TEST(Lz77, TexbinThroughput) {
+   auto input = synthetic_bgra(1024, 1024);
+
+   for (auto level : {LZ77_LEVEL_FAST, LZ77_LEVEL_DEFAULT, LZ77_LEVEL_MAX}) {
+      auto start = time_us();
+      auto comp = texbin_lz77_compress(input, level);
+      auto comp_us = time_us() - start;
+      start = time_us();
+      ASSERT_EQ(texbin_lz77_decompress(comp, 0, false), input);
+      auto decomp_us = time_us() - start;
+
+      log_info("texbin lz77 level %d: %d -> %d bytes, compress %d MB/s, decompress %d MB/s",
+         level, (int)input.size(), (int)comp.size(),
+         (int)(input.size() / std::max(comp_us, (uint64_t)1)),
+         (int)(input.size() / std::max(decomp_us, (uint64_t)1)));
+   }
+}
+
+TEST(Lz77, TexbinPartialDecode) {
+   auto input = synthetic_bgra(64, 64);
+   auto comp = texbin_lz77_compress(input);
+
+   for (size_t len : {1, 0x40, 1000, 16383}) {
+      auto partial = texbin_lz77_decompress(comp, len, false);
+      EXPECT_EQ(partial, std::vector<uint8_t>(input.begin(), input.begin() + len));
+   }
+}
+
+TEST(Lz77, AvslzRoundTrip) {
+   std::vector<std::vector<uint8_t>> inputs = {
+      {},
+      {1},
+      std::vector<uint8_t>(5000, 0),
+      std::vector<uint8_t>(5000, 7),
+      synthetic_bgra(64, 64),
+   };
+
+   for (auto &input : inputs) {
+      for (auto level : {LZ77_LEVEL_FAST, LZ77_LEVEL_DEFAULT, LZ77_LEVEL_MAX}) {
+         auto comp = lz77_compress(input.data(), input.size(), LZ77_FORMAT_AVSLZ, level);
+         // the end marker should stop it, not the length
+         EXPECT_EQ(lz77_decompress(comp.data(), comp.size(), input.size() + 100, LZ77_FORMAT_AVSLZ), input)
+            << input.size() << " bytes, level " << level;
+      }
+   }
+}
+
+TEST(Lz77, AvslzMatchesAvs) {
+   auto input = synthetic_bgra(256, 256);
+
+   // AVS can read ours
+   auto native = lz77_compress(input.data(), input.size(), LZ77_FORMAT_AVSLZ);
+   size_t avs_decomp_len = input.size();
+   auto avs_decomp = lz_decompress(native.data(), native.size(), &avs_decomp_len);
+   ASSERT_TRUE(avs_decomp);
+   EXPECT_EQ(std::vector<uint8_t>(avs_decomp, avs_decomp + avs_decomp_len), input);
+   free(avs_decomp);
+
+   // and we can read AVS's
+   size_t avs_comp_len;
+   auto avs_comp = lz_compress(input.data(), input.size(), &avs_comp_len);
+   ASSERT_TRUE(avs_comp);
+   EXPECT_EQ(lz77_decompress(avs_comp, avs_comp_len, input.size(), LZ77_FORMAT_AVSLZ), input);
+   free(avs_comp);
+}
+
+TEST(Swizzle, MatchesScalar) {
+   // odd lengths to exercise the scalar tails
+   for (size_t len : {0, 3, 4, 30, 64, 1000, 4096 + 6}) {
+      std::vector<uint8_t> input(len);
+      for (size_t i = 0; i < len; i++) {
+         input[i] = (uint8_t)(i * 7 + 3);
+      }
+
+      auto rb_expected = input;
+      swizzle_swap_rb(rb_expected.data(), len, SWIZZLE_SCALAR);
+      auto words_expected = input;
+      swizzle_swap_words(words_expected.data(), len, SWIZZLE_SCALAR);
+
+      for (int isa = SWIZZLE_SSE2; isa <= swizzle_best_isa(); isa++) {
+         auto rb = input;
+         swizzle_swap_rb(rb.data(), len, (swizzle_isa)isa);
+         EXPECT_EQ(rb, rb_expected) << len << " bytes, isa " << isa;
+
+         auto words = input;
+         swizzle_swap_words(words.data(), len, (swizzle_isa)isa);
+         EXPECT_EQ(words, words_expected) << len << " bytes, isa " << isa;
+      }
+   }
+}
+
+TEST(Dxt, ParallelMatchesSerial) {
+   // not a multiple of the band height, with a partial block row at the end
+   const int w = 260, h = 330;
+   auto rgba = synthetic_bgra(w, h);
+   size_t out_size = ((w + 3) / 4) * ((h + 3) / 4) * 16;
+
+   std::vector<uint8_t> serial(out_size), parallel(out_size);
+   rygCompress(serial.data(), rgba.data(), w, h, 1);
+   dxt_compress(parallel.data(), rgba.data(), w, h, DXT_FORMAT_DXT5, DXT_QUALITY_FAST);
+   EXPECT_EQ(serial, parallel);
+}
+
+TEST(Dxt, QualityTiers) {
+   const int w = 128, h = 128;
+   auto rgba = synthetic_bgra(w, h);
+
+   // squish weights colour error perceptually, so compare the tiers on the
+   // same metric they're actually minimising
+   static const double weights[4] = {0.2126, 0.7152, 0.0722, 1.0};
+   auto error = [&](dxt_quality_t quality) {
+      std::vector<uint8_t> dxt(w * h), decoded(w * h * 4);
+      auto start = time_us();
+      dxt_compress(dxt.data(), rgba.data(), w, h, DXT_FORMAT_DXT5, quality);
+      auto us = time_us() - start;
+      squish::DecompressImage(decoded.data(), w, h, dxt.data(), squish::kDxt5);
+
+      double err = 0;
+      for (size_t i = 0; i < decoded.size(); i++) {
+         double diff = (decoded[i] - rgba[i]) * weights[i % 4];
+         err += diff * diff;
+      }
+      log_info("dxt quality %s: error %.0f, %d us", dxt_quality_str(quality), err, (int)us);
+      return err;
+   };
+
+   auto fast = error(DXT_QUALITY_FAST);
+   auto high = error(DXT_QUALITY_HIGH);
+   auto best = error(DXT_QUALITY_BEST);
+   EXPECT_LE(high, fast);
+   EXPECT_LE(best, high);
+}
+
+TEST(Texbin, ImageCacheSkipsUnchangedImages) {
+   auto cache_folder = CACHE_FOLDER + "/texbin_image_cache";
+   ASSERT_TRUE(mkdir_p(cache_folder));
+
+   auto png = CACHE_FOLDER + "/texbin_cached.png";
+   auto other_png = CACHE_FOLDER + "/texbin_cached_other.png";
+   std::vector<uint8_t> img(16 * 16 * 4, 0x40), other(16 * 16 * 4, 0x80);
+   ASSERT_EQ(lodepng::encode(png, img, 16, 16), 0u);
+   ASSERT_EQ(lodepng::encode(other_png, other, 16, 16), 0u);
+   auto cache_file = cache_folder + "/IMG.tex";
+   DeleteFileA(cache_file.c_str());
+
+   auto replace = [&] {
+      Texbin texbin;
+      texbin.image_cache_folder = cache_folder;
+      EXPECT_TRUE(texbin.add_or_replace_image("IMG", png.c_str()));
+      auto &tex = texbin.images["IMG"];
+      return std::vector<uint8_t>(tex.tex_data(), tex.tex_data() + tex.tex_size());
+   };
+
+   auto fresh = replace();
+   ASSERT_TRUE(file_exists(cache_file.c_str()));
+
+   // swap the cached entry for a different image, which is only picked up if
+   // the PNG really is skipped
+   Texbin other_texbin;
+   other_texbin.add_or_replace_image("IMG", other_png.c_str());
+   auto &other_tex = other_texbin.images["IMG"];
+   std::vector<uint8_t> other_entry(other_tex.tex_data(), other_tex.tex_data() + other_tex.tex_size());
+   {
+      // keep the key and dimensions
+      char hdr[24];
+      std::ifstream in(cache_file, std::ios::binary);
+      ASSERT_TRUE(in.read(hdr, sizeof(hdr)));
+      in.close();
+      std::ofstream out(cache_file, std::ios::binary);
+      out.write(hdr, sizeof(hdr));
+      out.write((const char*)other_entry.data(), other_entry.size());
+   }
+   EXPECT_EQ(replace(), other_entry);
+
+   // a different output format is a different key
+   config.texbin_force_bgra = true;
+   EXPECT_EQ(replace(), fresh);
+   config.texbin_force_bgra = false;
+}
+
+TEST(Texbin, ReplaceKeepsDxtFormat) {
+   ASSERT_TRUE(mkdir_p(CACHE_FOLDER));
+
+   const int w = 64, h = 32;
+   auto rgba = synthetic_bgra(w, h);
+   auto png = CACHE_FOLDER + "/texbin_dxt_test.png";
+   ASSERT_EQ(lodepng::encode(png, rgba, w, h), 0u);
+
+   // an 8x8 DXT5 image to be replaced: 64 byte TDXT header then the blocks
+   std::vector<uint8_t> original(0x40 + 4 * 16);
+   memcpy(&original[0], "TDXT", 4);
+   uint32_t archive_size = (uint32_t)original.size();
+   memcpy(&original[0x0C], &archive_size, 4);
+   uint16_t dim = 8;
+   memcpy(&original[0x10], &dim, 2);
+   memcpy(&original[0x12], &dim, 2);
+   original[0x14] = 0x1A;
+
+   auto replaced = [&] {
+      Texbin texbin;
+      texbin.images["IMG"] = ImageEntryParsed(texbin_lz77_compress(original));
+      EXPECT_TRUE(texbin.add_or_replace_image("IMG", png.c_str()));
+      auto &entry = texbin.images["IMG"];
+      EXPECT_EQ(entry.peek_dimensions(), std::make_pair((uint16_t)w, (uint16_t)h));
+      return entry.tex_type_str(false);
+   };
+
+   EXPECT_EQ(replaced(), "DXT5");
+
+   config.texbin_force_bgra = true;
+   EXPECT_EQ(replaced(), "BGRA");
+   config.texbin_force_bgra = false;
+}
+
+TEST(Texbin, AlignedRectPatchesDxtBlocks) {
+   ASSERT_TRUE(mkdir_p(CACHE_FOLDER));
+
+   // a 64x36 DXT5 parent, so the last block row is partial
+   const int w = 64, h = 36;
+   auto rgba = synthetic_bgra(w, h);
+   std::vector<uint8_t> parent(0x40 + dxt_compressed_size(w, h, DXT_FORMAT_DXT5));
+   memcpy(&parent[0], "TDXT", 4);
+   uint32_t archive_size = (uint32_t)parent.size();
+   memcpy(&parent[0x0C], &archive_size, 4);
+   uint16_t dims[2] = {w, h};
+   memcpy(&parent[0x10], dims, sizeof(dims));
+   parent[0x14] = 0x1A;
+   dxt_compress(&parent[0x40], rgba.data(), w, h, DXT_FORMAT_DXT5, DXT_QUALITY_FAST);
+
+   // solid red, 2x3 blocks
+   std::vector<uint8_t> red(8 * 12 * 4, 0);
+   for (size_t i = 0; i < red.size(); i += 4) {
+      red[i] = red[i + 3] = 0xff;
+   }
+   auto png = CACHE_FOLDER + "/texbin_rect.png";
+   ASSERT_EQ(lodepng::encode(png, red, 8, 12), 0u);
+
+   Texbin texbin;
+   texbin.images["PARENT"] = ImageEntryParsed(texbin_lz77_compress(parent));
+   RectEntryParsed rect;
+   rect.parent_name = "PARENT";
+   rect.x = 8;
+   rect.y = 4;
+   rect.w = 8;
+   rect.h = 12;
+   texbin.rects["RECT"] = rect;
+   ASSERT_TRUE(texbin.add_or_replace_image("RECT", png.c_str()));
+   ASSERT_TRUE(texbin.save((CACHE_FOLDER + "/texbin_rect.bin").c_str()));
+
+   auto &patched = texbin.images["PARENT"];
+   EXPECT_EQ(patched.tex_type_str(false), "DXT5");
+   auto raw = texbin_lz77_decompress(patched.tex_data(), patched.tex_size(), 0, false);
+   ASSERT_EQ(raw.size(), parent.size());
+
+   // only the blocks under the rect are re-encoded
+   size_t changed = 0;
+   for (size_t block = 0x40; block < raw.size(); block += 16) {
+      if (memcmp(&raw[block], &parent[block], 16) != 0) {
+         changed++;
+      }
+   }
+   EXPECT_EQ(changed, 6u);
+
+   auto decoded = patched.tex_to_argb8888();
+   ASSERT_TRUE(decoded);
+   auto &pixels = std::get<0>(*decoded);
+   for (int y = rect.y; y < rect.y2(); y++) {
+      for (int x = rect.x; x < rect.x2(); x++) {
+         auto px = &pixels[(y * w + x) * 4];
+         EXPECT_EQ(px[0], 0xff);
+         EXPECT_EQ(px[1], 0);
+      }
+   }
+}
@@ -7,6 +7,8 @@
 #include <string.h>
 #include <windows.h>
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <string>
 #include <optional>
@@ -16,9 +18,15 @@
 
 #include "texbin.hpp"
 #include "avs.h"
+#include "config.hpp"
+#include "content_hash.hpp"
+#include "dxt.hpp"
 #include "log.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
 #include "3rd_party/lodepng.h"
 #include "3rd_party/libsquish/squish.h"
+#include "3rd_party/md5.h"
 
 using namespace std;
 using std::nullopt;
@@ -140,6 +148,20 @@ static_assert(sizeof(TexHdr) == 64, "Texbin tex header size is wrong");
 
 #pragma pack(pop)
 
+enum TexFormat: uint8_t {
+    GRAYSCALE_2 = 0x06,
+    GRAYSCALE   = 0x01,
+    BGR_16BIT   = 0x0C,
+    BGRA_16BIT  = 0x0D,
+    BGR         = 0x0E,
+    BGRA        = 0x10,
+    BGR_4BIT    = 0x11,
+    BGR_8BIT    = 0x12,
+    DXT1        = 0x16,
+    DXT3        = 0x18,
+    DXT5        = 0x1A,
+};
+
 // texbintool always sets little_endian=true, unsure where it's seen most often
 static vector<uint8_t> argb8888_to_texture_data(
         const unsigned char *image, unsigned width, unsigned height,
@@ -203,13 +225,21 @@ static vector<uint8_t> argb8888_to_texture_data(
     return texbin_lz77_compress(data);
 }
 
-static vector<string> load_names(istream &f, uint32_t name_offset) {
-    vector<string> ret;
+// bounds checked, since the offsets come straight from the file
+template<typename T>
+static bool read_at(const uint8_t *buf, size_t len, size_t offset, T &out) {
+    if(offset > len || len - offset < sizeof(T)) {
+        return false;
+    }
+    memcpy(&out, &buf[offset], sizeof(T));
+    return true;
+}
 
-    f.seekg(name_offset);
+static vector<string> load_names(const uint8_t *buf, size_t len, uint32_t name_offset) {
+    vector<string> ret;
 
     TexbinNamesHdr name_hdr;
-    if(!f.read((char*)&name_hdr, sizeof(name_hdr))) {
+    if(!read_at(buf, len, name_offset, name_hdr)) {
         log_warning("bad names");
         return ret;
     }
@@ -225,55 +255,48 @@ static vector<string> load_names(istream &f, uint32_t name_offset) {
 
     ret.resize(name_hdr.names_count);
     TexbinNameEntry entry;
-    for(uint32_t i = 0; i < name_hdr.names_count; i++) {
-        if(!f.read((char*)&entry, sizeof(entry))) {
+    size_t entry_offset = (size_t)name_offset + sizeof(name_hdr);
+    for(uint32_t i = 0; i < name_hdr.names_count; i++, entry_offset += sizeof(entry)) {
+        if(!read_at(buf, len, entry_offset, entry) || entry.id >= ret.size()) {
             log_warning("bad name entry at %" PRId32, i);
             return ret;
         }
-        auto pos = f.tellg();
 
-        f.seekg(name_offset + entry.str_offset);
-        string name = "";
-        char ch;
-        while(f.get(ch) && ch > '\0') {
-            name += ch;
+        size_t str_start = (size_t)name_offset + entry.str_offset;
+        size_t str_end = str_start;
+        while(str_end < len && (char)buf[str_end] > '\0') {
+            str_end++;
         }
-        if(!f) {
+        if(str_end >= len) {
             log_warning("bad name entry at %" PRId32, i);
             return ret;
         }
-        ret[entry.id] = name;
-
-        f.seekg(pos);
+        ret[entry.id] = string((const char*)&buf[str_start], str_end - str_start);
     }
 
     return ret;
 }
 
-static vector<vector<uint8_t>> load_data(istream &f, const TexbinHdr& hdr) {
+static vector<ImageEntryParsed> load_data(const uint8_t *buf, size_t len, const TexbinHdr& hdr, const shared_ptr<const void> &owner) {
     bool warned_about_size_mismatch = false;
 
-    vector<vector<uint8_t>> ret;
+    vector<ImageEntryParsed> ret;
     ret.reserve(hdr.file_count);
 
-    f.seekg(hdr.data_entry_offset);
-
     TexbinDataEntry entry;
-    for(uint32_t i = 0; i < hdr.file_count; i++) {
-        if(!f.read((char*)&entry, sizeof(entry))) {
+    size_t entry_offset = hdr.data_entry_offset;
+    for(uint32_t i = 0; i < hdr.file_count; i++, entry_offset += sizeof(entry)) {
+        if(!read_at(buf, len, entry_offset, entry)) {
             log_warning("bad data entry at %" PRId32, i);
             return ret;
         }
-        auto pos = f.tellg();
-
-        f.seekg(entry.offset);
 
         // the size *appears* to be the compressed size, but older (??) versions
         // of texbintool seem to emit the decompressed size, so do a quick read
         // and double check. The game seems to ignore the "bad" size and use the
         // actual data len, so they're not broken.
         uint32_t sizes[2];
-        if(!f.read((char*)&sizes[0], sizeof(sizes))) {
+        if(!read_at(buf, len, entry.offset, sizes)) {
             log_warning("can't read data at i %" PRId32 " offset %" PRId32,
                 i, entry.offset
             );
@@ -289,18 +312,13 @@ static vector<vector<uint8_t>> load_data(istream &f, const TexbinHdr& hdr) {
             entry.size = comp_len + 8;
         }
 
-        f.seekg(entry.offset);
-        vector<uint8_t> data;
-        data.resize(entry.size);
-        if(!f.read((char*)&data[0], entry.size)) {
+        if(len - entry.offset < entry.size) {
             log_warning("can't read data at i %" PRId32 " offset %" PRId32 " len %" PRId32,
                 i, entry.offset, entry.size
             );
             return ret;
         }
-        ret.push_back(data);
-
-        f.seekg(pos);
+        ret.emplace_back(&buf[entry.offset], entry.size, owner);
     }
 
     return ret;
@@ -326,20 +344,21 @@ uint32_t hash_name(const char *name) {
     return hash;
 }
 
-void pad32(ofstream &f) {
-    // pad to 4 bytes
-    auto pad = 4 - (f.tellp() % 4);
-    if(pad != 4) {
-        char zeros[4] = {0};
-        f.write(zeros, pad);
-    }
+template<typename T>
+static void append(vector<uint8_t> &out, const T &val) {
+    auto bytes = (const uint8_t*)&val;
+    out.insert(out.end(), bytes, bytes + sizeof(val));
 }
 
+static size_t pad32_len(size_t len) {
+    return (4 - (len % 4)) % 4;
+}
+
+// a complete names section, padded to 4 bytes
 template<typename T>
-void write_names(ofstream &f, map<string, T, CaseInsensitiveCompare> &names) {
-    auto start = f.tellp();
+static vector<uint8_t> build_names(const map<string, T, CaseInsensitiveCompare> &names) {
     TexbinNamesHdr hdr;
-    f.write((char*)&hdr, sizeof(hdr)); // update with real values later
+    vector<uint8_t> out(sizeof(hdr)); // update with real values later
 
     // Hashes are written in ascending order. Ensure this by using the (sorted)
     // std::map
@@ -359,39 +378,228 @@ void write_names(ofstream &f, map<string, T, CaseInsensitiveCompare> &names) {
 
     // now we've made and sorted the hashes, emit all the data
     for(auto &[_hash, entry] : entries) {
-        f.write((char*)&entry, sizeof(TexbinNameEntry));
+        append(out, entry);
     }
     for(auto &[name, _val] : names) {
-        f.write(name.c_str(), name.size() + 1);
+        out.insert(out.end(), name.c_str(), name.c_str() + name.size() + 1);
     }
 
-    pad32(f);
-
-    auto end = f.tellp();
+    out.resize(out.size() + pad32_len(out.size()));
 
     // update header with known values
-    hdr.sect_size = (uint32_t)(end - start);
+    hdr.sect_size = (uint32_t)out.size();
     hdr.names_count = (uint32_t)names.size();
     hdr.unkA = 1 << bit_length(hdr.names_count / 4);
     hdr.unkB = (1 << bit_length(hdr.names_count / 2)) - 1;
+    memcpy(&out[0], &hdr, sizeof(hdr));
 
-    f.seekp(start);
-    f.write((char*)&hdr, sizeof(hdr));
+    return out;
+}
 
-    // back to the end for our consumer
-    f.seekp(0, ios::end);
+// The expensive, independent half of adding an image - decoding the PNG and
+// building the compressed texture. Only reads the texbin, so several can run
+// at once.
+class PreparedImage {
+    public:
+    bool ok = false;
+    unsigned width, height;
+    // rect images are patched into their parent at save time, so stay decoded
+    vector<uint8_t> rect_data;
+    vector<uint8_t> tex;
+};
+
+// The decoded TexHdr of the image being replaced, or empty if there isn't one
+static vector<uint8_t> original_header(const Texbin &texbin, const char *image_name) {
+    auto existing = texbin.images.find(image_name);
+    if(existing == texbin.images.end()) {
+        return {};
+    }
+
+    // decoded directly rather than through the entry's header cache, since
+    // several of these may run at once
+    return texbin_lz77_decompress(existing->second.tex_data(), existing->second.tex_size(), sizeof(TexHdr), false);
 }
 
-bool Texbin::add_or_replace_image(const char *image_name, const char *png_path) {
+// The format of a decoded tex (or just its header), if it's DXT
+static optional<dxt_format_t> tex_dxt_format(const vector<uint8_t> &raw, bool &big_endian) {
+    if(raw.size() < sizeof(TexHdr)) {
+        return nullopt;
+    }
+
+    auto hdr = reinterpret_cast<const TexHdr*>(&raw[0]);
+    if(memcmp(hdr->magic, "TDXT", sizeof(hdr->magic)) == 0) {
+        big_endian = false;
+    } else if(memcmp(hdr->magic, "TXDT", sizeof(hdr->magic)) == 0) {
+        big_endian = true;
+    } else {
+        return nullopt;
+    }
+
+    auto format1 = big_endian ? _byteswap_ulong(hdr->format1) : hdr->format1;
+    switch(format1 & 0xFF) {
+        case TexFormat::DXT1: return DXT_FORMAT_DXT1;
+        case TexFormat::DXT3: return DXT_FORMAT_DXT3;
+        case TexFormat::DXT5: return DXT_FORMAT_DXT5;
+        default: return nullopt;
+    }
+}
+
+// Encode a replacement in the same block compressed format as the image it
+// replaces, keeping the original header. DXT entries as BGRA are 4-8x bigger,
+// which the game then has to decompress and upload. nullopt if the original
+// isn't DXT, so the caller falls back to BGRA.
+static optional<vector<uint8_t>> rgba_to_original_format(const vector<uint8_t> &raw,
+        const vector<uint8_t> &image, unsigned width, unsigned height) {
+    bool big_endian;
+    auto _format = tex_dxt_format(raw, big_endian);
+    if(!_format) {
+        return nullopt;
+    }
+    auto format = *_format;
+
+    TexHdr hdr;
+    memcpy(&hdr, &raw[0], sizeof(hdr));
+    auto data_size = dxt_compressed_size(width, height, format);
+    uint32_t archive_size = (uint32_t)(sizeof(TexHdr) + data_size);
+    hdr.width = big_endian ? _byteswap_ushort((uint16_t)width) : (uint16_t)width;
+    hdr.height = big_endian ? _byteswap_ushort((uint16_t)height) : (uint16_t)height;
+    hdr.archive_size = big_endian ? _byteswap_ulong(archive_size) : archive_size;
+
+    vector<uint8_t> data(archive_size);
+    memcpy(&data[0], &hdr, sizeof(hdr));
+    {
+        TraceSpan span("dxt");
+        dxt_compress(&data[sizeof(TexHdr)], &image[0], width, height, format, config.dxt_quality);
+    }
+
+    return texbin_lz77_compress(data);
+}
+
+// Cached entries start with the hash of everything that went into them, then
+// the image dimensions
+#define IMAGE_CACHE_HDR_SIZE (MD5::HashBytes + 2 * sizeof(uint32_t))
+
+static void image_cache_key(const char *png_path, const vector<uint8_t> &original,
+        uint8_t key[MD5::HashBytes]) {
+    MD5 digest;
+    digest_add_dll_version(digest);
+    digest.add(png_path, strlen(png_path));
+    digest_add_file_version(digest, png_path);
+    // the output format depends on these
+    digest.add(&config.texbin_force_bgra, sizeof(config.texbin_force_bgra));
+    digest.add(&config.dxt_quality, sizeof(config.dxt_quality));
+    if(original.size()) {
+        digest.add(&original[0], original.size());
+    }
+    digest.getHash(key);
+}
+
+static bool load_cached_image(const string &cache_path, const uint8_t key[MD5::HashBytes], PreparedImage &ret) {
+    auto f = fopen(cache_path.c_str(), "rb");
+    if(!f) {
+        return false;
+    }
+
+    uint8_t hdr[IMAGE_CACHE_HDR_SIZE];
+    bool ok = false;
+    if(fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr) && memcmp(hdr, key, MD5::HashBytes) == 0) {
+        uint32_t dims[2];
+        memcpy(dims, &hdr[MD5::HashBytes], sizeof(dims));
+        ret.width = dims[0];
+        ret.height = dims[1];
+
+        fseek(f, 0, SEEK_END);
+        auto len = ftell(f) - (long)sizeof(hdr);
+        fseek(f, sizeof(hdr), SEEK_SET);
+        if(len > 0) {
+            ret.tex.resize(len);
+            ok = fread(&ret.tex[0], 1, len, f) == (size_t)len;
+        }
+    }
+    fclose(f);
+
+    return ok;
+}
+
+static void save_cached_image(const string &cache_path, const uint8_t key[MD5::HashBytes], const PreparedImage &prepared) {
+    TraceSpan span("file write", cache_path.c_str());
+    // write then rename, so a short write can't leave a truncated image
+    // behind a valid key
+    auto tmp_path = cache_path + ".tmp";
+    auto f = fopen(tmp_path.c_str(), "wb");
+    if(!f) {
+        log_warning("Couldn't write texbin image cache %s", cache_path.c_str());
+        return;
+    }
+
+    uint32_t dims[2] = {prepared.width, prepared.height};
+    bool ok = fwrite(key, 1, MD5::HashBytes, f) == MD5::HashBytes
+        && fwrite(dims, 1, sizeof(dims), f) == sizeof(dims)
+        && fwrite(&prepared.tex[0], 1, prepared.tex.size(), f) == prepared.tex.size();
+    ok = (fclose(f) == 0) && ok;
+    if(!ok || !MoveFileExA(tmp_path.c_str(), cache_path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        log_warning("Couldn't write texbin image cache %s", cache_path.c_str());
+        DeleteFileA(tmp_path.c_str());
+    }
+}
+
+static PreparedImage prepare_image(const Texbin &texbin, const char *image_name, const char *png_path) {
+    PreparedImage ret;
+
+    // rect replacements stay as raw pixels until save, so only whole images
+    // are worth caching
+    bool is_rect = texbin.rects.find(image_name) != texbin.rects.end();
+    auto original = is_rect ? vector<uint8_t>() : original_header(texbin, image_name);
+
+    string cache_path;
+    uint8_t cache_key[MD5::HashBytes];
+    if(texbin.image_cache_folder && !is_rect) {
+        cache_path = *texbin.image_cache_folder + "/" + image_name + ".tex";
+        image_cache_key(png_path, original, cache_key);
+        if(load_cached_image(cache_path, cache_key, ret)) {
+            log_verbose("%s unchanged, using cached image", image_name);
+            ret.ok = true;
+            return ret;
+        }
+    }
+
     unsigned error;
     vector<uint8_t> image;
-    unsigned width, height;
-    error = lodepng::decode(image, width, height, png_path);
+    {
+        TraceSpan span("png decode", png_path);
+        error = lodepng::decode(image, ret.width, ret.height, png_path);
+    }
     if (error) {
         log_warning("Can't load png %u: %s\n", error, lodepng_error_text(error));
+        return ret;
+    }
+
+    // rect image names may shadow normal image names, so check them first
+    if(is_rect) {
+        ret.rect_data = std::move(image);
+    } else {
+        optional<vector<uint8_t>> dxt;
+        if(!config.texbin_force_bgra) {
+            dxt = rgba_to_original_format(original, image, ret.width, ret.height);
+        }
+        ret.tex = dxt ? std::move(*dxt) : argb8888_to_texture_data(&image[0], ret.width, ret.height);
+
+        if(cache_path.size()) {
+            save_cached_image(cache_path, cache_key, ret);
+        }
+    }
+
+    ret.ok = true;
+    return ret;
+}
+
+bool Texbin::apply_image(const char *image_name, PreparedImage &prepared) {
+    if (!prepared.ok) {
         return false;
     }
 
+    auto width = prepared.width;
+    auto height = prepared.height;
     auto existing_image = images.find(image_name);
     auto existing_rect = rects.find(image_name);
     // rect image names may shadow normal image names, so check them first
@@ -403,7 +611,7 @@ bool Texbin::add_or_replace_image(const char *image_name, const char *png_path)
             return false;
         }
         log_info("Replacing rect image %s", image_name);
-        existing_rect->second.dirty_data = image;
+        existing_rect->second.dirty_data = std::move(prepared.rect_data);
     } else if(existing_image != images.end()) {
         auto [w, h] = existing_image->second.peek_dimensions();
         if(width != w || height != h) {
@@ -413,23 +621,60 @@ bool Texbin::add_or_replace_image(const char *image_name, const char *png_path)
         }
 
         log_info("Replacing %s", image_name);
-        images[image_name] = ImageEntryParsed(argb8888_to_texture_data(&image[0], width, height));
+        images[image_name] = ImageEntryParsed(std::move(prepared.tex));
     } else{
         log_info("Adding new image %s", image_name);
-        images[image_name] = ImageEntryParsed(argb8888_to_texture_data(&image[0], width, height));
+        images[image_name] = ImageEntryParsed(std::move(prepared.tex));
     }
 
     return true;
 }
 
+bool Texbin::add_or_replace_image(const char *image_name, const char *png_path) {
+    auto prepared = prepare_image(*this, image_name, png_path);
+    return apply_image(image_name, prepared);
+}
+
+size_t Texbin::add_or_replace_images(const vector<pair<string, string>> &name_png_pairs, uint64_t *work_us) {
+    size_t added = 0;
+    std::atomic<uint64_t> total_work = 0;
+
+    // Decoded PNGs are big, so only work on a few more than we have threads at
+    // a time. Each batch is applied in order, so the output is identical to
+    // calling add_or_replace_image for each pair.
+    auto batch_size = (background_pool().thread_count() + 1) * 2;
+    for (size_t batch = 0; batch < name_png_pairs.size(); batch += batch_size) {
+        auto count = std::min(batch_size, name_png_pairs.size() - batch);
+        vector<PreparedImage> prepared(count);
+
+        background_pool().parallel_for(count, [&](size_t i) {
+            auto start = time_us();
+            auto &[name, png] = name_png_pairs[batch + i];
+            prepared[i] = prepare_image(*this, name.c_str(), png.c_str());
+            total_work += time_us() - start;
+        });
+
+        for (size_t i = 0; i < count; i++) {
+            if (apply_image(name_png_pairs[batch + i].first.c_str(), prepared[i])) {
+                added++;
+            }
+        }
+    }
+
+    if (work_us) {
+        *work_us = total_work;
+    }
+    return added;
+}
+
 void Texbin::debug() {
     uint32_t total = 0;
     for(auto &[name, image] : images) {
         [[maybe_unused]] auto [w,h] = image.peek_dimensions();
         VLOG("file: %s len %d fmt %s dims(%d,%d)",
-            name.c_str(), image.tex.size(), image.tex_type_str(false).c_str(),
+            name.c_str(), image.tex_size(), image.tex_type_str(false).c_str(),
             w, h);
-        total += (uint32_t)image.tex.size();
+        total += (uint32_t)image.tex_size();
     }
 
     for([[maybe_unused]] auto &[name, rect] : rects) {
@@ -442,13 +687,9 @@ void Texbin::debug() {
     VLOG("Total data: %d", total);
 }
 
-optional<Texbin> Texbin::from_stream(istream &f) {
-    f.seekg(0, ios::end);
-    auto file_len = f.tellg();
-    f.seekg(0);
-
+optional<Texbin> Texbin::from_buffer(const uint8_t *buf, size_t len, shared_ptr<const void> owner) {
     TexbinHdr hdr;
-    if(!f.read((char*)&hdr, sizeof(hdr))) {
+    if(!read_at(buf, len, 0, hdr)) {
         log_verbose("cannot read header");
         return nullopt;
     }
@@ -458,8 +699,8 @@ optional<Texbin> Texbin::from_stream(istream &f) {
         return nullopt;
     }
 
-    if(hdr.archive_size != file_len) {
-        log_warning("bad archive size (file said %d stream said %d)", hdr.archive_size, file_len);
+    if(hdr.archive_size != len) {
+        log_warning("bad archive size (file said %d buffer is %d)", hdr.archive_size, len);
         return nullopt;
     }
 
@@ -467,26 +708,27 @@ optional<Texbin> Texbin::from_stream(istream &f) {
     hdr.debug();
 #endif
 
-    auto names = load_names(f, 0 + hdr.name_offset);
+    auto names = load_names(buf, len, hdr.name_offset);
     if(names.size() != hdr.file_count) {
         log_warning("Name section mismatch against files");
         return nullopt;
     }
 
-    auto data = load_data(f, hdr);
+    auto data = load_data(buf, len, hdr, owner);
+    if(data.size() != hdr.file_count) {
+        log_warning("Data section mismatch against files");
+        return nullopt;
+    }
 
     map<string, ImageEntryParsed, CaseInsensitiveCompare> images;
-    // images.reserve(hdr.file_count);
-
     for(uint32_t i = 0; i < hdr.file_count; i++) {
-        images[names[i]] = ImageEntryParsed(data[i]);
+        images[names[i]] = std::move(data[i]);
     }
 
     map<string, RectEntryParsed, CaseInsensitiveCompare> rects;
     if(hdr.rect_offset) {
         TexbinRectHdr rect_hdr;
-        f.seekg(hdr.rect_offset);
-        if(!f.read((char*)&rect_hdr, sizeof(rect_hdr))) {
+        if(!read_at(buf, len, hdr.rect_offset, rect_hdr)) {
             log_warning("cannot read rect header");
             return nullopt;
         }
@@ -499,17 +741,17 @@ optional<Texbin> Texbin::from_stream(istream &f) {
         rect_hdr.debug();
 #endif
 
-        auto rect_names = load_names(f, hdr.rect_offset + rect_hdr.name_offset);
+        auto rect_names = load_names(buf, len, hdr.rect_offset + rect_hdr.name_offset);
 
         if(rect_names.size() != rect_hdr.image_count) {
             log_warning("Rect name section mismatch against files");
             return nullopt;
         }
 
-        f.seekg(hdr.rect_offset + rect_hdr.rect_entry_offset);
+        size_t entry_offset = (size_t)hdr.rect_offset + rect_hdr.rect_entry_offset;
         for(uint32_t i = 0; i < rect_hdr.image_count; i++) {
             TexbinRectEntry entry;
-            if(!f.read((char*)&entry, sizeof(entry))) {
+            if(!read_at(buf, len, entry_offset + i * sizeof(entry), entry)) {
                 log_warning("cannot read rect entry");
                 return nullopt;
             }
@@ -536,24 +778,159 @@ optional<Texbin> Texbin::from_stream(istream &f) {
         }
     }
 
-    auto ret = Texbin(images, rects);
+    auto ret = Texbin(std::move(images), std::move(rects));
 #ifdef TEXBIN_VERBOSE
     ret.debug();
 #endif
     return ret;
 }
 
+optional<Texbin> Texbin::from_stream(istream &f) {
+    f.seekg(0, ios::end);
+    auto file_len = f.tellg();
+    f.seekg(0);
+    if(file_len < 0) {
+        log_verbose("cannot read stream");
+        return nullopt;
+    }
+
+    auto buf = make_shared<vector<uint8_t>>((size_t)file_len);
+    if(buf->size() && !f.read((char*)buf->data(), buf->size())) {
+        log_verbose("cannot read stream");
+        return nullopt;
+    }
+
+    return Texbin::from_buffer(buf->data(), buf->size(), buf);
+}
+
 optional<Texbin> Texbin::from_path(const char *path) {
     // there are a handful of .bin files we might try to parse that *aren't*
     // texbins, so gate all logs before header magic check behind log_verbose
     log_verbose("Opening %s", path);
-    ifstream f (path, ios::binary);
-    if(!f) {
+    auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) {
         log_verbose("cannot open");
         return nullopt;
     }
 
-    return Texbin::from_stream(f);
+    // can't map an empty file, but it's not a texbin anyway
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if(GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    CloseHandle(file);
+    if(!mapping) {
+        log_verbose("cannot map");
+        return nullopt;
+    }
+
+    // the view holds its own reference to the mapping
+    auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if(!view) {
+        log_verbose("cannot map");
+        return nullopt;
+    }
+
+    shared_ptr<const void> owner(view, [](const void *view) { UnmapViewOfFile(view); });
+    return Texbin::from_buffer((const uint8_t*)view, (size_t)size.QuadPart, owner);
+}
+
+// Encodes each rect straight into the parent's blocks, leaving the rest of
+// the canvas alone. Only possible when every rect starts on a block, and ends
+// on one or at the canvas edge. False if the parent needs a full re-encode.
+static bool patch_dxt_rects(ImageEntryParsed &image, const vector<RectEntryParsed*> &rects) {
+    if(config.texbin_force_bgra) {
+        return false;
+    }
+
+    // check the header first, so misaligned rects don't decode twice
+    auto raw = texbin_lz77_decompress(image.tex_data(), image.tex_size(), sizeof(TexHdr));
+    bool big_endian;
+    auto format = tex_dxt_format(raw, big_endian);
+    if(!format) {
+        return false;
+    }
+
+    auto hdr = reinterpret_cast<const TexHdr*>(&raw[0]);
+    size_t width = big_endian ? _byteswap_ushort(hdr->width) : hdr->width;
+    size_t height = big_endian ? _byteswap_ushort(hdr->height) : hdr->height;
+    for(auto &rect : rects) {
+        if(rect->x % 4 || rect->y % 4 ||
+                (rect->w % 4 && rect->x2() != width) ||
+                (rect->h % 4 && rect->y2() != height) ||
+                rect->x2() > width || rect->y2() > height) {
+            return false;
+        }
+    }
+
+    raw = texbin_lz77_decompress(image.tex_data(), image.tex_size());
+    if(raw.size() < sizeof(TexHdr) + dxt_compressed_size((int)width, (int)height, *format)) {
+        return false;
+    }
+
+    auto parent_row = dxt_compressed_size((int)width, 4, *format);
+    for(auto &rect : rects) {
+        auto rect_row = dxt_compressed_size(rect->w, 4, *format);
+        auto block_rows = (rect->h + 3) / 4;
+        vector<uint8_t> blocks(rect_row * block_rows);
+        TraceSpan span("dxt", rect->parent_name.c_str());
+        dxt_compress(&blocks[0], &(*rect->dirty_data)[0], rect->w, rect->h, *format, config.dxt_quality);
+
+        auto dst = &raw[sizeof(TexHdr)] + (rect->y / 4) * parent_row + dxt_compressed_size(rect->x, 4, *format);
+        for(size_t y = 0; y < block_rows; y++) {
+            memcpy(dst + y * parent_row, &blocks[y * rect_row], rect_row);
+        }
+
+        rect->dirty_data = nullopt;
+    }
+
+    image = ImageEntryParsed(texbin_lz77_compress(raw));
+    return true;
+}
+
+static void patch_rects(const string &parent_name, ImageEntryParsed &image, const vector<RectEntryParsed*> &rects) {
+    if(patch_dxt_rects(image, rects)) {
+        return;
+    }
+
+    auto _tex = image.tex_to_argb8888();
+    if(!_tex) {
+        log_warning("Can't update rect %s: cannot load tex", parent_name.c_str());
+        return;
+    }
+    auto [tex, width, height] = *_tex;
+
+    for(auto &rect : rects) {
+        if(rect->x2() > width || rect->y2() > height) {
+            log_warning("Can't update rect in %s: out of bounds (canvas is %dx%d, rect is x1,x2,y1,y2 %d,%d,%d,%d)",
+                parent_name.c_str(),
+                width,
+                height,
+                rect->x, rect->x2(), rect->y, rect->y2()
+            );
+            continue;
+        }
+
+        auto &dirty = *rect->dirty_data;
+
+        for(size_t y = 0; y < rect->h; y++) {
+            size_t src_start = y * rect->w * 4;
+            size_t dst_start = ((y + rect->y) * width * 4) + (rect->x * 4);
+            size_t len = rect->w * 4;
+            memcpy(&tex[dst_start], &dirty[src_start], len);
+        }
+
+        rect->dirty_data = nullopt;
+    }
+
+    optional<vector<uint8_t>> dxt;
+    if(!config.texbin_force_bgra) {
+        auto raw = texbin_lz77_decompress(image.tex_data(), image.tex_size(), sizeof(TexHdr));
+        dxt = rgba_to_original_format(raw, tex, width, height);
+    }
+    image = ImageEntryParsed(dxt ? std::move(*dxt) : argb8888_to_texture_data(&tex[0], width, height));
 }
 
 void Texbin::process_dirty_rects() {
@@ -565,95 +942,61 @@ void Texbin::process_dirty_rects() {
         }
     }
 
+    vector<tuple<const string*, ImageEntryParsed*, const vector<RectEntryParsed*>*>> parents;
     for(auto &[rect_name, rects] : updates) {
-        auto _image = images.find(rect_name);
-        if(_image == images.end()) {
+        auto image = images.find(rect_name);
+        if(image == images.end()) {
             log_warning("Can't update rect %s: no tex???", rect_name.c_str());
             continue;
         }
-        auto image = &_image->second;
-        auto _tex = image->tex_to_argb8888();
-        if(!_tex) {
-            log_warning("Can't update rect %s: cannot load tex", rect_name.c_str());
-            continue;
-        }
-        auto [tex, width, height] = *_tex;
-
-        for(auto &rect : rects) {
-            if(rect->x2() > width || rect->y2() > height) {
-                log_warning("Can't update rect in %s: out of bounds (canvas is %dx%d, rect is x1,x2,y1,y2 %d,%d,%d,%d)",
-                    rect_name.c_str(),
-                    width,
-                    height,
-                    rect->x, rect->x2(), rect->y, rect->y2()
-                );
-                continue;
-            }
-
-            auto dirty = *rect->dirty_data;
-
-            for(size_t y = 0; y < rect->h; y++) {
-                size_t src_start = y * rect->w * 4;
-                size_t dst_start = ((y + rect->y) * width * 4) + (rect->x * 4);
-                size_t len = rect->w * 4;
-                memcpy(&tex[dst_start], &dirty[src_start], len);
-            }
-
-            rect->dirty_data = nullopt;
-        }
-
-        image->tex = argb8888_to_texture_data(&tex[0], width, height);
+        parents.emplace_back(&rect_name, &image->second, &rects);
     }
+
+    // every parent is its own image, so they can all be re-encoded at once
+    background_pool().parallel_for(parents.size(), [&](size_t i) {
+        auto [name, image, rects] = parents[i];
+        patch_rects(*name, *image, *rects);
+    });
 }
 
 bool Texbin::save(const char *dest) {
-    ofstream f(dest, ios::binary);
-    if(!f) {
-        log_warning("Can't open output");
-        return false;
-    }
-
     process_dirty_rects(); // update any rect textures we modified
+    TraceSpan span("file write", dest);
 
+    // Everything except the image data is small, so lay the whole file out up
+    // front and then write it start to finish. Sections are all 4 byte
+    // aligned.
     TexbinHdr hdr;
-
-    f.write((char*)&hdr, sizeof(hdr)); // updated later
-    hdr.name_offset = (uint32_t)f.tellp();
-    write_names(f, images);
-
-    hdr.data_entry_offset = (uint32_t)f.tellp();
-    uint32_t data_offset = hdr.data_entry_offset + (uint32_t)(images.size() * sizeof(TexbinDataEntry));
+    vector<uint8_t> head(sizeof(hdr)); // header, names and data entries
+    hdr.name_offset = (uint32_t)head.size();
+    auto names = build_names(images);
+    head.insert(head.end(), names.begin(), names.end());
+
+    hdr.data_entry_offset = (uint32_t)head.size();
+    hdr.data_offset = hdr.data_entry_offset + (uint32_t)(images.size() * sizeof(TexbinDataEntry));
+    uint32_t data_offset = hdr.data_offset;
     for(auto &[_name, data] : images) {
         TexbinDataEntry entry;
-        entry.size = (uint32_t)data.tex.size();
+        entry.size = (uint32_t)data.tex_size();
         entry.offset = data_offset;
-        f.write((char*)&entry, sizeof(entry));
+        append(head, entry);
 
-        data_offset += (uint32_t)data.tex.size();
-        uint32_t pad = 4 - (data.tex.size() % 4);
-        if(pad != 4) {
-            data_offset += pad;
-        }
-    }
-
-    hdr.data_offset = (uint32_t)f.tellp();
-
-    for(auto &[_name, data] : images) {
-        f.write((char*)&data.tex[0], data.tex.size());
         // the test files I have all seem to conform to this, but texbintool
         // only aligns the entire section. Better safe than sorry...
-        pad32(f);
+        data_offset += (uint32_t)(data.tex_size() + pad32_len(data.tex_size()));
     }
 
+    vector<uint8_t> rect_section;
     if(rects.size()) {
-        hdr.rect_offset = (uint32_t)f.tellp();
+        hdr.rect_offset = data_offset;
         TexbinRectHdr rect_hdr;
-        f.write((char*)&rect_hdr, sizeof(rect_hdr));
-        rect_hdr.name_offset = (uint32_t)f.tellp() - hdr.rect_offset;
+        rect_section.resize(sizeof(rect_hdr));
+        rect_hdr.name_offset = (uint32_t)rect_section.size();
 
-        write_names(f, rects);
+        auto rect_names = build_names(rects);
+        rect_section.insert(rect_section.end(), rect_names.begin(), rect_names.end());
 
-        rect_hdr.rect_entry_offset = (uint32_t)f.tellp() - hdr.rect_offset;
+        rect_hdr.rect_entry_offset = (uint32_t)rect_section.size();
         for(auto &[name, rect] : rects) {
             auto parent = images.find(rect.parent_name);
             if(parent == images.end()) {
@@ -669,36 +1012,97 @@ bool Texbin::save(const char *dest) {
             entry.y1 = rect.y;
             entry.x2 = rect.x + rect.w;
             entry.y2 = rect.y + rect.h;
-            f.write((char*)&entry, sizeof(entry));
+            append(rect_section, entry);
         }
 
-        uint32_t rect_end = (uint32_t)f.tellp();
-        rect_hdr.sect_size = rect_end - hdr.rect_offset;
+        rect_hdr.sect_size = (uint32_t)rect_section.size();
         rect_hdr.image_count = (uint32_t)rects.size();
-        f.seekp(hdr.rect_offset);
-        f.write((char*)&rect_hdr, sizeof(rect_hdr));
-        f.seekp(0, ios::end);
+        memcpy(&rect_section[0], &rect_hdr, sizeof(rect_hdr));
     } else {
         hdr.rect_offset = 0;
     }
 
-    // update header with actual written values
-    hdr.archive_size = (uint32_t)f.tellp();
+    hdr.archive_size = data_offset + (uint32_t)rect_section.size();
     hdr.file_count = (uint32_t)images.size();
+    memcpy(&head[0], &hdr, sizeof(hdr));
+
+    ofstream f(dest, ios::binary);
+    if(!f) {
+        log_warning("Can't open output");
+        return false;
+    }
+
+    f.write((const char*)&head[0], head.size());
+
+    // Images that weren't replaced still point into the original file, where
+    // they're usually already back to back with matching padding. Each such
+    // run goes out as one big write, so rebuilding with a handful of changed
+    // images costs about as much as copying the file.
+    static const uint8_t zeros[4] = {0};
+    const ImageEntryParsed *run_entry = nullptr;
+    const uint8_t *run = nullptr;
+    size_t run_len = 0;
+    size_t run_pad = 0; // padding owed after the run
+    auto flush_run = [&] {
+        if(run_len) {
+            f.write((const char*)run, run_len);
+        }
+        if(run_pad) {
+            f.write((const char*)zeros, run_pad);
+        }
+        run_len = run_pad = 0;
+    };
+
+    for(auto &[_name, data] : images) {
+        auto tex = data.tex_data();
+        auto len = data.tex_size();
+        if(!len) {
+            continue;
+        }
+
+        // only join images from the same buffer, so the padding between them
+        // is safe to read
+        bool contiguous = run_len && data.shares_source(*run_entry)
+            && tex == run + run_len + run_pad
+            && memcmp(run + run_len, zeros, run_pad) == 0;
+        if(contiguous) {
+            run_len += run_pad + len;
+        } else {
+            flush_run();
+            run = tex;
+            run_len = len;
+        }
+        run_entry = &data;
+        run_pad = pad32_len(len);
+    }
+    flush_run();
 
-    f.seekp(0);
-    f.write((char*)&hdr, sizeof(hdr));
+    if(rect_section.size()) {
+        f.write((const char*)&rect_section[0], rect_section.size());
+    }
 
+    if(!f) {
+        log_warning("Can't write output");
+        return false;
+    }
     return true;
 }
 
+const vector<uint8_t>& ImageEntryParsed::header(bool debug_lz77) {
+    if(!raw_header) {
+        raw_header = texbin_lz77_decompress(tex_ptr, tex_len, sizeof(TexHdr), debug_lz77);
+    }
+
+    return *raw_header;
+}
+
 pair<uint16_t, uint16_t> ImageEntryParsed::peek_dimensions() {
-    auto raw = texbin_lz77_decompress(tex, 0x40);
-    if(raw.size() < 0x40) {
+    auto &raw = header();
+    if(raw.size() < sizeof(TexHdr)) {
         return make_pair(0, 0);
     }
 
-    auto hdr = reinterpret_cast<TexHdr*>(&raw[0]);
+    auto hdr = reinterpret_cast<const TexHdr*>(&raw[0]);
     // note: texbintool has a different check. I think this is better?
     if(memcmp(hdr->magic, "TDXT", sizeof(hdr->magic)) == 0) {
         // little endian
@@ -710,37 +1114,25 @@ pair<uint16_t, uint16_t> ImageEntryParsed::peek_dimensions() {
     }
 }
 
-enum TexFormat: uint8_t {
-    GRAYSCALE_2 = 0x06,
-    GRAYSCALE   = 0x01,
-    BGR_16BIT   = 0x0C,
-    BGRA_16BIT  = 0x0D,
-    BGR         = 0x0E,
-    BGRA        = 0x10,
-    BGR_4BIT    = 0x11,
-    BGR_8BIT    = 0x12,
-    DXT1        = 0x16,
-    DXT3        = 0x18,
-    DXT5        = 0x1A,
-};
-
 string ImageEntryParsed::tex_type_str(bool debug_lz77) {
-    auto raw = texbin_lz77_decompress(tex, 0x40, debug_lz77);
-    if(raw.size() < 0x40) {
+    auto &raw = header(debug_lz77);
+    if(raw.size() < sizeof(TexHdr)) {
         return "SHORT TEX " + to_string(raw.size());
     }
 
-    auto hdr = reinterpret_cast<TexHdr*>(&raw[0]);
+    auto hdr = reinterpret_cast<const TexHdr*>(&raw[0]);
+    uint32_t format1;
     // note: texbintool has a different check. I think this is better?
     if(memcmp(hdr->magic, "TDXT", sizeof(hdr->magic)) == 0) {
         // little endian, nothing to do
+        format1 = hdr->format1;
     } else if(memcmp(hdr->magic, "TXDT", sizeof(hdr->magic)) == 0) {
-        hdr->format1 = _byteswap_ulong(hdr->format1);
+        format1 = _byteswap_ulong(hdr->format1);
     } else {
         return "BAD TEX";
     }
 
-    switch(hdr->format1 & 0xFF) {
+    switch(format1 & 0xFF) {
         case TexFormat::GRAYSCALE_2: return "GRAYSCALE_2";
         case TexFormat::GRAYSCALE:   return "GRAYSCALE";
         case TexFormat::BGR_16BIT:   return "BGR_16BIT";
@@ -753,15 +1145,18 @@ string ImageEntryParsed::tex_type_str(bool debug_lz77) {
         case TexFormat::DXT3:        return "DXT3";
         case TexFormat::DXT5:        return "DXT5";
 
-        default: return "UNK " + to_string(hdr->format1 & 0xFF);
+        default: return "UNK " + to_string(format1 & 0xFF);
     }
 }
 
 optional<tuple<vector<uint8_t>, uint16_t, uint16_t>> ImageEntryParsed::tex_to_argb8888() {
-    auto raw = texbin_lz77_decompress(tex);
+    auto raw = texbin_lz77_decompress(tex_ptr, tex_len);
     if(raw.size() < 0x40) {
         return nullopt;
     }
+    if(!raw_header) {
+        raw_header = vector<uint8_t>(&raw[0], &raw[sizeof(TexHdr)]);
+    }
 
     auto hdr = reinterpret_cast<TexHdr*>(&raw[0]);
     vector<uint8_t> data(&raw[0x40], &raw[raw.size()]);
@@ -902,112 +1297,27 @@ optional<tuple<vector<uint8_t>, uint16_t, uint16_t>> ImageEntryParsed::tex_to_ar
 // Which itself is based on: https://github.com/gdkchan/LegaiaText/blob/bbec0465428a9ff1858e4177588599629ca43302/LegaiaText/Legaia/Compression/LZSS.cs
 // Many thanks to windyfairy for this, without which this layeredfs feature would
 // not exist
-vector<uint8_t> texbin_lz77_compress(const vector<uint8_t> &data) {
-    vector<uint8_t> output(8, 0); // fill 8 bytes for header
-    output.reserve(data.size()); // should be performant enough
-
-    uint64_t lookup[0x10000];
-
-    vector<uint8_t> dict(0x1000, 0);
-
-    size_t dict_i = 4078;
-    size_t data_i = 0;
-    size_t bits_i = 0;
-
-    uint16_t mask = 0x80;
-
-    uint8_t header = 0;
-
-    while (data_i < data.size()) {
-        if ((mask <<= 1) == 0x100) {
-            output[bits_i] = header;
-
-            bits_i = output.size();
-            output.push_back(0);
-
-            header = 0;
-            mask = 1;
-        }
-
-        uint32_t length = 2;
-        int32_t dict_pos = 0;
-
-        if (data_i + 2 < data.size()) {
-            uint32_t value;
-
-            value = data[data_i + 0] << 8;
-            value |= data[data_i + 1] << 0;
-
-            for (int32_t i = 0; i < 5; i++) {
-                uint32_t index = (uint32_t)((lookup[value] >> (i * 12)) & 0xfff);
-
-                //First byte doesn't match, so the others won't match too
-                if (data[data_i] != dict[index]) break;
-
-                //Temporary dictionary used on comparisons
-                auto cmp_dict = dict;
-                size_t cmp_addr = dict_i;
-
-                uint32_t match_len = 0;
+vector<uint8_t> texbin_lz77_compress(const vector<uint8_t> &data, lz77_level level) {
+    TraceSpan span("lz compress");
+    auto comp = lz77_compress(data.size() ? &data[0] : NULL, data.size(), LZ77_FORMAT_TEXBIN, level);
 
-                for (int32_t j = 0; j < 18 && data_i + j < data.size(); j++) {
-                    if (cmp_dict[(index + j) & 0xfff] == data[data_i + j])
-                        match_len++;
-                    else
-                        break;
-
-                    cmp_dict[cmp_addr] = data[data_i + j];
-                    cmp_addr = (cmp_addr + 1) & 0xfff;
-                }
-
-                if (match_len > length && match_len < output.size()) {
-                    length = match_len;
-                    dict_pos = index;
-                }
-            }
-        }
-
-        if (length > 2) {
-            output.push_back(dict_pos);
-
-            uint32_t niblo = (length - 3) & 0xf;
-            uint32_t nibhi = (dict_pos >> 4) & 0xf0;
-
-            output.push_back((niblo | nibhi));
-        } else {
-            header |= (uint8_t)mask;
-
-            output.push_back(data[data_i]);
-
-            length = 1;
-        }
-
-        for (uint32_t i = 0; i < length; i++) {
-            if (data_i + 1 < data.size()) {
-                uint32_t value;
-
-                value = data[data_i + 0] << 8;
-                value |= data[data_i + 1] << 0;
-
-                lookup[value] <<= 12;
-                lookup[value] |= (uint32_t)dict_i;
-            }
-
-            dict[dict_i] = data[data_i++];
-            dict_i = (dict_i + 1) & 0xfff;
-        }
-    }
-
-    output[bits_i] = header;
+    vector<uint8_t> output(8 + comp.size());
     *(uint32_t*)&output[0] = _byteswap_ulong((uint32_t)data.size());
-    *(uint32_t*)&output[4] = _byteswap_ulong((uint32_t)(output.size() - 8));
+    *(uint32_t*)&output[4] = _byteswap_ulong((uint32_t)comp.size());
+    if (comp.size()) {
+        memcpy(&output[8], &comp[0], comp.size());
+    }
 
     return output;
 }
 
-vector<uint8_t> texbin_lz77_decompress(const vector<uint8_t> &comp_with_hdr, size_t max_len, bool debug) {
-    size_t decomp_len = _byteswap_ulong(*(uint32_t*)&comp_with_hdr[0]);
-    size_t comp_len = _byteswap_ulong(*(uint32_t*)&comp_with_hdr[4]);
+vector<uint8_t> texbin_lz77_decompress(const uint8_t *comp_with_hdr, size_t len, size_t max_len, bool debug) {
+    if(len < 8) {
+        return {};
+    }
+
+    size_t decomp_len = _byteswap_ulong(*(const uint32_t*)&comp_with_hdr[0]);
+    size_t comp_len = _byteswap_ulong(*(const uint32_t*)&comp_with_hdr[4]);
     auto comp = &comp_with_hdr[8];
     if(debug) {
         VLOG("%s: Comp sz %u decomp sz %u (clamp: %d)",
@@ -1021,51 +1331,10 @@ vector<uint8_t> texbin_lz77_decompress(const vector<uint8_t> &comp_with_hdr, siz
 
     // actually not compressed
     if(comp_len == 0) {
-        size_t data_len = min(decomp_len, comp_with_hdr.size() - 8);
+        size_t data_len = min(decomp_len, len - 8);
         return vector<uint8_t>(comp, comp + data_len);
     }
 
-    vector<uint8_t> decomp;
-    decomp.reserve(decomp_len);
-
-    uint8_t window[4096] = {0};
-    uint32_t comp_i = 0, window_i = 4078;
-
-    uint8_t control = 0;
-
-    while (comp_i < comp_len) {
-        control = comp[comp_i++];
-
-        for(auto i = 0; i < 8 && decomp.size() < decomp_len; i++) {
-            if ((control & 0x01) != 0) {
-                if (comp_i >= comp_len) {
-                    return decomp;
-                }
-
-                decomp.push_back(window[window_i++] = comp[comp_i++]);
-
-                window_i &= 0xfff;
-            } else {
-                size_t slide_off = (((comp[comp_i + 1] & 0xf0) << 4) | comp[comp_i]) & 0xfff;
-                size_t slide_len = (comp[comp_i + 1] & 0x0f) + 3;
-                comp_i += 2;
-
-                if (decomp.size() + slide_len > decomp_len) {
-                    slide_len = decomp_len - decomp.size();
-                }
-
-                while (slide_len > 0) {
-                    decomp.push_back(window[window_i++] = window[slide_off++]);
-
-                    window_i &= 0xfff;
-                    slide_off &= 0xfff;
-                    slide_len--;
-                }
-            }
-
-            control >>= 1;
-        }
-    }
-
-    return decomp;
+    comp_len = min(comp_len, len - 8);
+    return lz77_decompress(comp, comp_len, decomp_len, LZ77_FORMAT_TEXBIN);
 }
@@ -2,9 +2,11 @@
 
 #include <string>
 #include <map>
+#include <memory>
 #include <vector>
 #include <optional>
 
+#include "lz77.hpp"
 #include "utils.hpp"
 
 using namespace std;
@@ -13,20 +15,37 @@ using namespace std;
 // from every other place konami games use it. smh.
 // This differs from texbintools in that it JUST compresses, and doesn't add
 // or parse the length headers
-vector<uint8_t> texbin_lz77_compress(const vector<uint8_t> &data);
-// max_len is a soft clamp, you may get a few extra bytes
-vector<uint8_t> texbin_lz77_decompress(const vector<uint8_t> &comp_with_hdr, size_t max_len = 0, bool debug = true);
+vector<uint8_t> texbin_lz77_compress(const vector<uint8_t> &data, lz77_level level = LZ77_LEVEL_DEFAULT);
+// max_len clamps the output, so just the start can be decoded cheaply
+vector<uint8_t> texbin_lz77_decompress(const uint8_t *comp_with_hdr, size_t len, size_t max_len = 0, bool debug = true);
+inline vector<uint8_t> texbin_lz77_decompress(const vector<uint8_t> &comp_with_hdr, size_t max_len = 0, bool debug = true) {
+    return texbin_lz77_decompress(comp_with_hdr.data(), comp_with_hdr.size(), max_len, debug);
+}
 
 class ImageEntryParsed {
     public:
-    vector<uint8_t> tex;
-
     ImageEntryParsed(vector<uint8_t> tex)
-        : tex(tex)
-    {}
-    ImageEntryParsed()
-        : tex(vector<uint8_t>())
+        : source(make_shared<const vector<uint8_t>>(std::move(tex)))
+    {
+        auto &owned = *static_pointer_cast<const vector<uint8_t>>(source);
+        tex_ptr = owned.data();
+        tex_len = owned.size();
+    }
+    // Borrows tex from a parsed texbin instead of copying it. source keeps it
+    // alive, if null the buffer must outlive every copy of this entry.
+    ImageEntryParsed(const uint8_t *tex, size_t len, shared_ptr<const void> source)
+        : source(std::move(source))
+        , tex_ptr(tex)
+        , tex_len(len)
     {}
+    ImageEntryParsed() = default;
+
+    // the compressed tex, including its length header. Immutable, replacing an
+    // image makes a new entry
+    const uint8_t *tex_data() const {return tex_ptr;};
+    size_t tex_size() const {return tex_len;};
+    // if both borrow from the same buffer
+    bool shares_source(const ImageEntryParsed &other) const {return source == other.source;};
 
     // w/h
     pair<uint16_t, uint16_t> peek_dimensions();
@@ -34,6 +53,16 @@ class ImageEntryParsed {
     optional<tuple<vector<uint8_t>, uint16_t, uint16_t>> tex_to_argb8888();
     // used in debug output
     string tex_type_str(bool debug_lz77 = true);
+
+    private:
+    shared_ptr<const void> source;
+    const uint8_t *tex_ptr = nullptr;
+    size_t tex_len = 0;
+
+    // the decompressed 0x40 byte TexHdr, or less if the tex is truncated.
+    // Filled on first use
+    optional<vector<uint8_t>> raw_header;
+    const vector<uint8_t>& header(bool debug_lz77 = true);
 };
 
 class RectEntryParsed {
@@ -48,6 +77,8 @@ class RectEntryParsed {
     inline uint16_t y2() {return y + h;};
 };
 
+class PreparedImage;
+
 class Texbin {
     public:
 
@@ -60,6 +91,9 @@ class Texbin {
     // support packing a new texture into an existing rect (please let this
     // remain a never-needed usecase)
     map<string, RectEntryParsed, CaseInsensitiveCompare> rects;
+    // If set, replacement images are cached here once compressed, and only
+    // re-encoded when their PNG (or what it's replacing) changes
+    optional<string> image_cache_folder;
 
     Texbin(
         map<string, ImageEntryParsed, CaseInsensitiveCompare> images,
@@ -71,12 +105,24 @@ class Texbin {
 
     Texbin() = default;
 
+    // Memory maps the file, which stays mapped (and can't be overwritten) until
+    // every image parsed from it is replaced or destroyed
     static optional<Texbin> from_path(const char *path);
+    // Parses in place, with images pointing into buf until they're replaced.
+    // owner is kept alive for as long as any of them do - if it's null, buf
+    // must outlive the Texbin and every copy of it.
+    static optional<Texbin> from_buffer(const uint8_t *buf, size_t len, shared_ptr<const void> owner = nullptr);
+    // reads the whole stream into memory, then from_buffer
     static optional<Texbin> from_stream(istream &f);
     bool add_or_replace_image(const char *image_name, const char *png_path);
+    // Same as calling add_or_replace_image for each (name, png path) pair, but
+    // the PNGs are decoded and compressed in parallel. Returns how many were
+    // added, and optionally the total time spent by every worker.
+    size_t add_or_replace_images(const vector<pair<string, string>> &name_png_pairs, uint64_t *work_us = nullptr);
     bool save(const char *dest);
     void debug();
 
     private:
     void process_dirty_rects();
+    bool apply_image(const char *image_name, PreparedImage &prepared);
 };
@@ -0,0 +1,154 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <climits>
+
+#include "hook.h"
+#include "log.hpp"
+
+ThreadPoolTask::ThreadPoolTask() {
+    done_event = CreateEventA(NULL, TRUE, FALSE, NULL);
+}
+
+ThreadPoolTask::~ThreadPoolTask() {
+    CloseHandle(done_event);
+}
+
+void ThreadPoolTask::wait() {
+    WaitForSingleObject(done_event, INFINITE);
+}
+
+bool ThreadPoolTask::done() {
+    return WaitForSingleObject(done_event, 0) == WAIT_OBJECT_0;
+}
+
+ThreadPool::ThreadPool(size_t threads)
+    : threads(threads ? threads : 1)
+{
+    jobs_available = CreateSemaphoreA(NULL, 0, LONG_MAX, NULL);
+}
+
+void ThreadPool::start_workers() {
+    // called with jobs_lock held
+    if (!workers.empty()) {
+        return;
+    }
+
+    for (size_t i = 0; i < threads; i++) {
+        auto thread = CreateThread(NULL, 0, worker_main, this, 0, NULL);
+        if (!thread) {
+            log_warning("Couldn't start worker thread: %d", GetLastError());
+            continue;
+        }
+        workers.push_back(thread);
+    }
+}
+
+DWORD WINAPI ThreadPool::worker_main(LPVOID param) {
+    auto pool = (ThreadPool*)param;
+
+    while (true) {
+        WaitForSingleObject(pool->jobs_available, INFINITE);
+
+        pool->jobs_lock.lock();
+        auto [job, task] = std::move(pool->jobs.front());
+        pool->jobs.pop_front();
+        pool->jobs_lock.unlock();
+
+        job();
+        SetEvent(task->done_event);
+    }
+
+    return 0;
+}
+
+std::shared_ptr<ThreadPoolTask> ThreadPool::submit(std::function<void()> job) {
+    auto task = std::make_shared<ThreadPoolTask>();
+
+    jobs_lock.lock();
+    start_workers();
+    if (workers.empty()) {
+        // no threads at all, may as well do it now
+        jobs_lock.unlock();
+        job();
+        SetEvent(task->done_event);
+        return task;
+    }
+    jobs.emplace_back(std::move(job), task);
+    jobs_lock.unlock();
+
+    ReleaseSemaphore(jobs_available, 1, NULL);
+    return task;
+}
+
+struct parallel_for_t {
+    const std::function<void(size_t)> *fn;
+    size_t count;
+    std::atomic<size_t> next = 0;
+    std::atomic<size_t> finished = 0;
+    HANDLE all_finished;
+
+    parallel_for_t(const std::function<void(size_t)> *fn, size_t count)
+        : fn(fn)
+        , count(count)
+        , all_finished(CreateEventA(NULL, TRUE, FALSE, NULL))
+    {}
+    ~parallel_for_t() {
+        CloseHandle(all_finished);
+    }
+};
+
+// claim and run items until there are none left
+static void parallel_for_drain(parallel_for_t &state) {
+    while (true) {
+        auto i = state.next.fetch_add(1);
+        if (i >= state.count) {
+            return;
+        }
+
+        (*state.fn)(i);
+
+        if (state.finished.fetch_add(1) + 1 == state.count) {
+            SetEvent(state.all_finished);
+        }
+    }
+}
+
+static size_t cpu_count() {
+    static size_t cpus = [] {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return (size_t)info.dwNumberOfProcessors;
+    }();
+
+    return cpus;
+}
+
+void ThreadPool::parallel_for(size_t count, const std::function<void(size_t)> &fn) {
+    // helpers would just fight the caller for a single core
+    if (count <= 1 || inside_dllmain || cpu_count() <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    auto state = std::make_shared<parallel_for_t>(&fn, count);
+
+    // Helpers that start after everything is claimed exit without touching fn,
+    // so it's fine for it to go out of scope once we return
+    auto helpers = std::min(count - 1, threads);
+    for (size_t i = 0; i < helpers; i++) {
+        submit([state] { parallel_for_drain(*state); });
+    }
+
+    parallel_for_drain(*state);
+    WaitForSingleObject(state->all_finished, INFINITE);
+}
+
+ThreadPool& background_pool() {
+    // leaked on purpose, workers may still be waiting on it at unload
+    static ThreadPool *pool = new ThreadPool(cpu_count() > 1 ? cpu_count() - 1 : 1);
+
+    return *pool;
+}
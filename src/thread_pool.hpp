@@ -0,0 +1,61 @@
+#pragma once
+
+#include <windows.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "winxp_mutex.hpp"
+
+// A job submitted to a ThreadPool, which can be waited on
+class ThreadPoolTask {
+    public:
+    ThreadPoolTask();
+    ~ThreadPoolTask();
+
+    // block until the job has run
+    void wait();
+    bool done();
+
+    private:
+    friend class ThreadPool;
+    HANDLE done_event;
+};
+
+// A tiny fixed-size pool, using nothing newer than XP (so no condition
+// variables or the Vista thread pool API). Threads are only started on first
+// use, so constructing one is free.
+class ThreadPool {
+    public:
+    explicit ThreadPool(size_t threads);
+    // workers are never joined: pools are expected to live until process exit
+    ~ThreadPool() = delete;
+
+    // Queue a job to run in the background
+    std::shared_ptr<ThreadPoolTask> submit(std::function<void()> job);
+
+    // Call fn(i) for every i in [0, count), returning once all have finished.
+    // The calling thread runs items as well, so this is safe to call from
+    // inside a pool job. Runs everything inline while the loader lock is held,
+    // because threads can't start until DllMain returns.
+    void parallel_for(size_t count, const std::function<void(size_t)> &fn);
+
+    size_t thread_count() {return threads;};
+
+    private:
+    size_t threads;
+    std::vector<HANDLE> workers;
+    std::deque<std::pair<std::function<void()>, std::shared_ptr<ThreadPoolTask>>> jobs;
+    CriticalSectionLock jobs_lock;
+    HANDLE jobs_available;
+
+    void start_workers();
+    static DWORD WINAPI worker_main(LPVOID param);
+};
+
+// Shared pool sized to the machine, leaving a core free for the game
+ThreadPool& background_pool();
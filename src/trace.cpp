@@ -0,0 +1,133 @@
+#include "trace.hpp"
+
+#include <windows.h>
+#include <stdio.h>
+
+#include <atomic>
+
+#include "log.hpp"
+#include "winxp_mutex.hpp"
+
+#define TRACE_CHUNK_EVENTS 1024
+
+typedef struct {
+    const char *name;
+    std::string detail;
+    uint64_t start_us;
+    uint64_t dur_us;
+} trace_event_t;
+
+// Only the owning thread writes, and an event is never touched again once
+// `count` covers it, so trace_dump reads along without stopping anyone.
+typedef struct trace_chunk_t {
+    trace_event_t events[TRACE_CHUNK_EVENTS];
+    std::atomic<uint32_t> count;
+    std::atomic<trace_chunk_t*> next;
+} trace_chunk_t;
+
+typedef struct thread_trace_t {
+    DWORD tid;
+    trace_chunk_t *first;
+    trace_chunk_t *last;
+    thread_trace_t *next;
+} thread_trace_t;
+
+// Pushed onto without a lock, so the only lock trace_dump takes is its own.
+// Never freed, threads that have exited still count.
+static std::atomic<thread_trace_t*> all_thread_traces;
+thread_local static thread_trace_t *my_trace;
+
+static thread_trace_t& thread_trace() {
+    if (!my_trace) {
+        my_trace = new thread_trace_t();
+        my_trace->tid = GetCurrentThreadId();
+        my_trace->first = my_trace->last = new trace_chunk_t();
+        my_trace->next = all_thread_traces.load(std::memory_order_relaxed);
+        while (!all_thread_traces.compare_exchange_weak(my_trace->next, my_trace,
+                std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+    return *my_trace;
+}
+
+void trace_record(const char *name, std::string &&detail, uint64_t start_us, uint64_t end_us) {
+    auto &trace = thread_trace();
+
+    auto chunk = trace.last;
+    auto count = chunk->count.load(std::memory_order_relaxed);
+    if (count == TRACE_CHUNK_EVENTS) {
+        auto next = new trace_chunk_t();
+        chunk->next.store(next, std::memory_order_release);
+        trace.last = chunk = next;
+        count = 0;
+    }
+
+    auto &event = chunk->events[count];
+    event.name = name;
+    event.detail = std::move(detail);
+    event.start_us = start_us;
+    event.dur_us = end_us - start_us;
+    chunk->count.store(count + 1, std::memory_order_release);
+}
+
+// paths are the only thing that needs it, but they can have backslashes
+static void write_json_string(FILE *f, const std::string &str) {
+    fputc('"', f);
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+void trace_dump(void) {
+    if (!config.trace_file) {
+        return;
+    }
+
+    static CriticalSectionLock dump_mtx;
+    dump_mtx.lock();
+
+    auto f = fopen(config.trace_file, "wb");
+    if (!f) {
+        log_warning("Couldn't open trace file %s", config.trace_file);
+        dump_mtx.unlock();
+        return;
+    }
+
+    auto pid = GetCurrentProcessId();
+    size_t written = 0;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (auto trace = all_thread_traces.load(std::memory_order_acquire); trace; trace = trace->next) {
+        for (auto chunk = trace->first; chunk; chunk = chunk->next.load(std::memory_order_acquire)) {
+            auto count = chunk->count.load(std::memory_order_acquire);
+            for (uint32_t i = 0; i < count; i++) {
+                auto &event = chunk->events[i];
+                fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"layeredfs\",\"ph\":\"X\","
+                    "\"ts\":%llu,\"dur\":%llu,\"pid\":%lu,\"tid\":%lu",
+                    written ? ",\n" : "", event.name,
+                    (unsigned long long)event.start_us, (unsigned long long)event.dur_us,
+                    (unsigned long)pid, (unsigned long)trace->tid);
+                if (event.detail.size()) {
+                    fprintf(f, ",\"args\":{\"detail\":");
+                    write_json_string(f, event.detail);
+                    fputc('}', f);
+                }
+                fputc('}', f);
+                written++;
+            }
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    log_info("Wrote %d trace events to %s", written, config.trace_file);
+    dump_mtx.unlock();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+#include "config.hpp"
+#include "utils.hpp"
+
+// A timeline of where cache generation spends its time, per thread. Only
+// collected with --layered-trace: otherwise every span pays a single branch.
+// The file loads in chrome://tracing or https://ui.perfetto.dev
+
+// `name` must be a string literal, it's kept as-is until the trace is written
+void trace_record(const char *name, std::string &&detail, uint64_t start_us, uint64_t end_us);
+// Write everything recorded so far to config.trace_file
+void trace_dump(void);
+
+// Records a span from construction to destruction. `detail` (a path, usually)
+// shows up when the span is clicked on.
+class TraceSpan {
+    public:
+    explicit TraceSpan(const char *name, const char *detail = "")
+        : name(name)
+        , start(config.trace_file ? time_us() : 0)
+    {
+        if (start) {
+            this->detail = detail;
+        }
+    }
+    ~TraceSpan() {
+        if (start) {
+            trace_record(name, std::move(detail), start, time_us());
+        }
+    }
+
+    private:
+    const char *name;
+    std::string detail;
+    uint64_t start;
+};
@@ -4,9 +4,11 @@
 #include <algorithm>
 
 #include "utils.hpp"
+#include "content_hash.hpp"
 #include "log.hpp"
 #include "avs.h"
 #include "hook.h"
+#include "modpath_handler.h"
 
 char* snprintf_auto(const char* fmt, ...) {
     va_list argList;
@@ -100,6 +102,11 @@ wchar_t *str_widen(const char *src)
 }
 
 bool file_exists(const char* name) {
+    uint64_t size, mtime;
+    if (mod_file_attribs_cached(name, size, mtime)) {
+        return mtime != 0;
+    }
+
     // file_exists is only used by the modfile machinery, so use the easy
     // method, not avs_fs_open or avs_fs_lstat
     DWORD dwAttrib = GetFileAttributesA(name);
@@ -148,6 +155,15 @@ std::string path_to_actual_case(std::string path) {
     return path;
 }
 
+uint32_t string_hash_icase(const char *str, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)tolower((uint8_t)str[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
 void str_toupper_inline(std::string& str) {
     for (size_t i = 0; i < str.length(); i++) {
         str[i] = toupper(str[i]);
@@ -181,25 +197,22 @@ std::vector<std::string> folders_in_folder(const char* root) {
 }
 
 uint64_t file_time(const char* path) {
-    auto wide = str_widen(path);
-    auto hFile = CreateFileW(wide,  // file to open
-        GENERIC_READ,          // open for reading
-        FILE_SHARE_READ,       // share for reading
-        NULL,                  // default security
-        OPEN_EXISTING,         // existing file only
-        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, // normal file
-        NULL);                 // no attr. template
-    free(wide);
-    if (hFile == INVALID_HANDLE_VALUE)
-        return 0;
+    uint64_t cached_size, cached_mtime;
+    if (mod_file_attribs_cached(path, cached_size, cached_mtime)) {
+        return cached_mtime;
+    }
 
-    FILETIME mtime;
-    GetFileTime(hFile, NULL, NULL, &mtime);
-    CloseHandle(hFile);
+    // a path query, so no handle to open and close, which matters for the
+    // cache files checked every time a texture is loaded
+    WIN32_FILE_ATTRIBUTE_DATA attribs;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attribs) ||
+        (attribs.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        return 0;
+    }
 
     ULARGE_INTEGER result;
-    result.LowPart = mtime.dwLowDateTime;
-    result.HighPart = mtime.dwHighDateTime;
+    result.LowPart = attribs.ftLastWriteTime.dwLowDateTime;
+    result.HighPart = attribs.ftLastWriteTime.dwHighDateTime;
     // log_verbose("file time %lu for %s", result.QuadPart, path);
     return result.QuadPart;
 
@@ -216,10 +229,36 @@ uint64_t file_time(const char* path) {
     // }
 }
 
+uint64_t folder_time(const char* path) {
+    WIN32_FILE_ATTRIBUTE_DATA attribs;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attribs) ||
+        !(attribs.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        return 0;
+    }
+
+    ULARGE_INTEGER result;
+    result.LowPart = attribs.ftLastWriteTime.dwLowDateTime;
+    result.HighPart = attribs.ftLastWriteTime.dwHighDateTime;
+    return result.QuadPart;
+}
+
 LONG time(void) {
-    SYSTEMTIME time;
-    GetSystemTime(&time);
-    return (time.wSecond * 1000) + time.wMilliseconds;
+    // from the first call, so it takes 24 days to overflow
+    static uint64_t start = time_us();
+    return (LONG)((time_us() - start) / 1000);
+}
+
+uint64_t time_us(void) {
+    static LARGE_INTEGER freq = [] {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        return f;
+    }();
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 +
+        (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
 }
 
 string basename_without_extension(string const & path) {
@@ -229,8 +268,8 @@ string basename_without_extension(string const & path) {
 }
 
 CacheHasher::CacheHasher(std::string hash_file): hash_file(hash_file) {
-    // always hash the DLL time
-    digest.add(&dll_time, sizeof(dll_time));
+    // always hash the DLL version
+    digest_add_dll_version(digest);
 
     auto cache_hashfile = fopen(hash_file.c_str(), "rb");
     if (cache_hashfile) {
@@ -241,9 +280,11 @@ CacheHasher::CacheHasher(std::string hash_file): hash_file(hash_file) {
 
 void CacheHasher::add(std::string &path) {
     digest.add(path.c_str(), path.length());
+    digest_add_file_version(digest, path.c_str());
+}
 
-    auto ts = file_time(path.c_str());
-    digest.add(&ts, sizeof(ts));
+void CacheHasher::add_bytes(const void *data, size_t len) {
+    digest.add(data, len);
 }
 
 void CacheHasher::finish() {
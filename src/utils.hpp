@@ -31,16 +31,25 @@ bool folder_exists(const char* name);
 std::string path_to_actual_case(std::string path);
 std::vector<std::string> folders_in_folder(const char* root);
 uint64_t file_time(const char* path);
+// last write time of a folder, or 0 if it doesn't exist
+uint64_t folder_time(const char* path);
+// monotonic milliseconds, for timing long operations
 LONG time(void);
+// monotonic microseconds, for timing short operations
+uint64_t time_us(void);
+
 std::string basename_without_extension(std::string const & path);
 
 // Hashes the names and timestamps of input files into a rebuilt output.
-// Invalidates on DLL timestamp change, input timestamp change, or input change
+// Invalidates on DLL timestamp change, input timestamp change, or input change.
+// With --layered-content-hash, file contents are used instead of timestamps.
 class CacheHasher {
     public:
     CacheHasher(std::string hash_file);
     // add a path and its timestamp to the hash. Should not be called after `finish`
     void add(std::string &path);
+    // add some raw bytes, for settings that change the output. Same rules as `add`
+    void add_bytes(const void *data, size_t len);
     // complete the hashing op
     void finish();
     // check if the hashfile matches
@@ -61,4 +70,19 @@ struct CaseInsensitiveCompare {
     }
 };
 
+// FNV-1a of the lowercased string, so it agrees with CaseInsensitiveEqual
+uint32_t string_hash_icase(const char *str, size_t len);
+
+struct CaseInsensitiveHash {
+    size_t operator() (const std::string& str) const {
+        return string_hash_icase(str.c_str(), str.length());
+    }
+};
+
+struct CaseInsensitiveEqual {
+    bool operator() (const std::string& a, const std::string& b) const {
+        return a.length() == b.length() && strcasecmp(a.c_str(), b.c_str()) == 0;
+    }
+};
+
 typedef std::unordered_set<std::string> string_set;